@@ -16,8 +16,8 @@ public:
         parseOBJFile(fileName);
     }
 
-    std::vector<float> getVertices() const { return vertices; }
-    std::vector<uint32_t> getIndices() const { return indices; }
+    const std::vector<float>& getVertices() const { return vertices; }
+    const std::vector<uint32_t>& getIndices() const { return indices; }
 
 private:
     // obj model parser will work strictly with triangulated meshes for now
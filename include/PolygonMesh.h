@@ -3,46 +3,196 @@
 
 #include "hittable.h"
 #include "triangle.h"
+#include "triangle_block.h"
 #include "OBJModel.h"
+#include "bvh.h"
+#include <algorithm>
 #include <vector>
 
 class PolygonMesh : public hittable {
 public:
-    PolygonMesh(OBJModel objModel, std::shared_ptr<material> mat) {
+    PolygonMesh(const OBJModel& objModel, std::shared_ptr<material> mat) {
         // Retrieve the vertices and indices from the OBJModel
-        std::vector<float> vertices = objModel.getVertices();
-        std::vector<uint32_t> indices = objModel.getIndices();
+        const std::vector<float>& vertices = objModel.getVertices();
+        const std::vector<uint32_t>& indices = objModel.getIndices();
 
         // Create triangles from the parsed data
-        for (size_t i = 0; i < indices.size(); i+= 3) {
+        std::vector<triangle> parsed;
+        parsed.reserve(indices.size() / 3);
+        for (size_t i = 0; i + 2 < indices.size(); i+= 3) {
             point3 v0(vertices[3 * indices[i]], vertices[3 * indices[i] + 1], vertices[3 * indices[i] + 2]);
             point3 v1(vertices[3 * indices[i+1]], vertices[3 * indices[i+1] + 1], vertices[3 * indices[i+1] + 2]);
             point3 v2(vertices[3 * indices[i+2]], vertices[3 * indices[i+2] + 1], vertices[3 * indices[i+2] + 2]);
-            
-            triangles.push_back(std::make_shared<triangle>(v0, v1, v2, mat));
+
+            parsed.emplace_back(v0, v1, v2, mat);
         }
+
+        build(parsed);
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        bool hit_something = false;
-        auto closest_so_far = ray_t.max;
+        if (!intersect(r, ray_t, rec))
+            return false;
+        surface_interaction(r, rec);
+        return true;
+    }
 
-        for (const auto& tri : triangles) {
-            if (tri -> hit(r, ray_t, rec)) {
-                hit_something = true;
-                closest_so_far = rec.t;
+    // Walks the triangle hierarchy, only the leaves whose box the ray crosses are tested, and
+    // each leaf is tested as one block of triangles against the closest hit found so far
+    // Records the closest triangle in rec.element, with its distance and barycentric coordinates.
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        triangle_block_ray block_ray(r);
+        uint64_t tests = 0;
+
+        bool hit_anything = tree.intersect_leaves(r, ray_t, [&](uint32_t first, uint32_t count, const interval& t_range, double& t) {
+            tests += count;
+
+            float lane_t[8];
+            float tmin = static_cast<float>(std::max(t_range.min, static_cast<double>(kEpsilon)));
+            float tmax = static_cast<float>(t_range.max);
+            unsigned mask = block_width == 8
+                ? intersect_triangles(blocks8[block_of[first]], block_ray, tmin, tmax, lane_t)
+                : intersect_triangles(blocks4[block_of[first]], block_ray, tmin, tmax, lane_t);
+            if (mask == 0)
+                return false;
+
+            int lane = -1;
+            for (int i = 0; i < block_width; i++) {
+                if ((mask & (1u << i)) && (lane < 0 || lane_t[i] < lane_t[lane]))
+                    lane = i;
             }
+
+            // Redo the closest hit in double precision, keeping the float distance if rounding
+            // pushed the refined one out of the interval
+            const triangle& tri = triangles[first + lane];
+            tri.barycentric(r, rec.t, rec.u, rec.v);
+            if (!(rec.t > t_range.min && rec.t < t_range.max))
+                rec.t = lane_t[lane];
+
+            rec.object = this;
+            rec.element = first + lane;
+            t = rec.t;
+            return true;
+        });
+
+        // Counters are updated once per ray rather than once per leaf
+        numRayTrianglesTests.fetch_add(tests, std::memory_order_relaxed);
+        if (hit_anything) {
+            numRayTrianglesIsect.fetch_add(1, std::memory_order_relaxed);
+            objectIsect.fetch_add(1, std::memory_order_relaxed);
         }
+        return hit_anything;
+    }
 
-        return hit_something;
+    void surface_interaction(const ray& r, hit_record& rec) const override {
+        const triangle& tri = triangles[rec.element];
+        rec.p = r.at(rec.t);
+        rec.normal = tri.normal;
+        rec.material_id = tri.material_id;
+    }
+
+    // Any lane of a leaf's block that hits ends the walk, there is no closest hit to refine
+    bool occluded(const ray& r, interval ray_t) const override {
+        triangle_block_ray block_ray(r);
+        uint64_t tests = 0;
+
+        bool blocked = tree.occluded_leaves(r, ray_t, [&](uint32_t first, uint32_t count, const interval& t_range) {
+            tests += count;
+
+            float lane_t[8];
+            float tmin = static_cast<float>(std::max(t_range.min, static_cast<double>(kEpsilon)));
+            float tmax = static_cast<float>(t_range.max);
+            unsigned mask = block_width == 8
+                ? intersect_triangles(blocks8[block_of[first]], block_ray, tmin, tmax, lane_t)
+                : intersect_triangles(blocks4[block_of[first]], block_ray, tmin, tmax, lane_t);
+            return mask != 0;
+        });
+
+        numRayTrianglesTests.fetch_add(tests, std::memory_order_relaxed);
+        if (blocked) {
+            numRayTrianglesIsect.fetch_add(1, std::memory_order_relaxed);
+            objectIsect.fetch_add(1, std::memory_order_relaxed);
+        }
+        return blocked;
     }
 
     aabb bounding_box() const override { return bbox; }
 
+    // The vertices are hashed once when the mesh is built, they do not change after that
+    void hash_state(state_hasher& h) const override {
+        h.add("PolygonMesh");
+        h.add(geometry_hash);
+        for (uint32_t material_id : materials)
+            scene_materials()[material_id]->hash_state(h);
+    }
+
 
 private:
-    std::vector<std::shared_ptr<triangle>> triangles;
-    aabb bbox;
+    std::vector<triangle> triangles;        // Triangles, reordered so each leaf is a contiguous range
+    std::vector<triangle_block<4>> blocks4; // One block per leaf when block_width is 4
+    std::vector<triangle_block<8>> blocks8; // One block per leaf when block_width is 8
+    std::vector<uint32_t> block_of;         // Block of the leaf starting at each triangle position
+    int block_width = 4;                    // Triangles per block, also the leaf size
+    linear_bvh tree;                        // Hierarchy over the triangles
+    aabb bbox;                              // Box around the whole mesh
+    uint64_t geometry_hash = 0;             // Hash of the triangles' vertices and sidedness
+    std::vector<uint32_t> materials;        // Materials of the triangles, each once
+
+    // Builds the hierarchy, stores the triangles in leaf order and packs every leaf into a block
+    void build(const std::vector<triangle>& parsed) {
+        std::vector<aabb> tri_bounds;
+        tri_bounds.reserve(parsed.size());
+        for (const auto& tri : parsed)
+            tri_bounds.push_back(tri.bounding_box().pad());
+
+        block_width = triangle_block_width();
+        tree.build(tri_bounds, block_width);
+
+        triangles.reserve(parsed.size());
+        for (uint32_t i : tree.primitive_order())
+            triangles.push_back(parsed[i]);
+
+        block_of.assign(triangles.size(), 0);
+        for (const auto& node : tree.nodes) {
+            if (node.count == 0) continue;
+
+            if (block_width == 8) {
+                block_of[node.offset] = static_cast<uint32_t>(blocks8.size());
+                blocks8.push_back(pack<8>(node.offset, node.count));
+            } else {
+                block_of[node.offset] = static_cast<uint32_t>(blocks4.size());
+                blocks4.push_back(pack<4>(node.offset, node.count));
+            }
+        }
+
+        bbox = tree.bounds();
+
+        state_hasher geometry;
+        for (const auto& tri : triangles) {
+            geometry.add(tri.v0);
+            geometry.add(tri.v1);
+            geometry.add(tri.v2);
+            geometry.add(tri.singleSided);
+            if (std::find(materials.begin(), materials.end(), tri.material_id) == materials.end())
+                materials.push_back(tri.material_id);
+        }
+        geometry_hash = geometry.value();
+    }
+
+    // Block holding the count triangles starting at position first, unused lanes never hit
+    template <int N>
+    triangle_block<N> pack(uint32_t first, uint32_t count) const {
+        triangle_block<N> block;
+        for (int lane = 0; lane < N; lane++) {
+            if (lane < static_cast<int>(count)) {
+                const triangle& tri = triangles[first + lane];
+                block.set(lane, tri.v0, tri.v1, tri.v2);
+            } else {
+                block.clear(lane);
+            }
+        }
+        return block;
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -51,6 +51,26 @@ class aabb {
             if (n == 2) return z;
             return x;
         }
+
+        // Returns the center point of the box
+        point3 centroid() const {
+            return point3(0.5*(x.min + x.max), 0.5*(y.min + y.max), 0.5*(z.min + z.max));
+        }
+
+        // Returns the surface area of the box, used by the surface area heuristic
+        double surface_area() const {
+            // An empty box has no area
+            if (x.size() < 0 || y.size() < 0 || z.size() < 0) return 0.0;
+
+            return 2.0 * (x.size()*y.size() + y.size()*z.size() + z.size()*x.size());
+        }
+
+        // Returns the index of the axis with the largest extent
+        int longest_axis() const {
+            if (x.size() > y.size())
+                return x.size() > z.size() ? 0 : 2;
+            return y.size() > z.size() ? 1 : 2;
+        }
        
         // Test for ray intersection
         // Employing the slab method
@@ -97,9 +117,11 @@ class aabb {
             if (tzmin > txmin) txmin = tzmin;
             if (tzmax < txmax) txmax = tzmax;
 
-            // Update the ray_t interval to reflect the exact t-values where it intersects the box
-            ray_t.min = txmin;
-            ray_t.max = txmax;
+            // The box only counts if the overlap lies within the ray's own interval, this lets
+            // boxes behind the ray origin or beyond the closest hit found so far be skipped
+            if ((txmax < ray_t.min) || (txmin > ray_t.max)) {
+                return false;
+            }
 
             // Increment the bounding volume intersection counter
             boundingVolumeIsect.fetch_add(1);
@@ -0,0 +1,941 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "main.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "morton.h"
+#include "parallel.h"
+#include "ray_footprint.h"
+#include "wide_bvh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// Number of buckets the centroid range is divided into when evaluating split candidates
+static const int kSAHBuckets = 12;
+
+// Splits items[start, end) into two groups using the surface area heuristic (SAH).
+// The cost of a split is estimated as SA(left)*count(left) + SA(right)*count(right), the
+// centroids are binned into buckets along each axis and the cheapest bucket boundary is used.
+// bounds_of(item) must return the aabb of an item.
+// Returns the index of the first item of the right group, and the chosen axis through split_axis.
+template <typename T, typename BoundsFn>
+size_t sah_partition(std::vector<T>& items, size_t start, size_t end, BoundsFn bounds_of, int& split_axis) {
+    size_t mid = start + (end - start) / 2;
+
+    // Bounds of the primitive centroids, the split planes are placed inside this box
+    aabb centroid_bounds;
+    for (size_t i = start; i < end; i++) {
+        point3 c = bounds_of(items[i]).centroid();
+        centroid_bounds = aabb(centroid_bounds, aabb(c, c));
+    }
+
+    split_axis = centroid_bounds.longest_axis();
+
+    double best_cost = infinity;
+    int best_bucket = -1;
+
+    for (int axis = 0; axis < 3; axis++) {
+        const interval& extent = centroid_bounds.axis(axis);
+
+        // All centroids share the same coordinate on this axis, no plane can separate them
+        if (!(extent.size() > 0)) continue;
+
+        aabb bucket_bounds[kSAHBuckets];
+        size_t bucket_count[kSAHBuckets] = {};
+
+        // Drop every centroid into its bucket
+        for (size_t i = start; i < end; i++) {
+            aabb box = bounds_of(items[i]);
+            int b = static_cast<int>(kSAHBuckets * ((box.centroid()[axis] - extent.min) / extent.size()));
+            b = std::min(std::max(b, 0), kSAHBuckets - 1);
+            bucket_count[b]++;
+            bucket_bounds[b] = aabb(bucket_bounds[b], box);
+        }
+
+        // Sweep from the right to collect the cost of everything past each boundary
+        double right_area[kSAHBuckets];
+        size_t right_count[kSAHBuckets];
+        aabb right_box;
+        size_t count = 0;
+        for (int b = kSAHBuckets - 1; b > 0; b--) {
+            right_box = aabb(right_box, bucket_bounds[b]);
+            count += bucket_count[b];
+            right_area[b] = right_box.surface_area();
+            right_count[b] = count;
+        }
+
+        // Sweep from the left and evaluate the boundary after each bucket
+        aabb left_box;
+        count = 0;
+        for (int b = 0; b < kSAHBuckets - 1; b++) {
+            left_box = aabb(left_box, bucket_bounds[b]);
+            count += bucket_count[b];
+
+            if (count == 0 || right_count[b+1] == 0) continue;
+
+            double cost = left_box.surface_area() * count + right_area[b+1] * right_count[b+1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_bucket = b;
+                split_axis = axis;
+            }
+        }
+    }
+
+    // Move every item that falls into a bucket at or before the best boundary to the left side
+    if (best_bucket >= 0) {
+        const interval& extent = centroid_bounds.axis(split_axis);
+        auto first_right = std::partition(items.begin() + start, items.begin() + end,
+            [&](const T& item) {
+                int b = static_cast<int>(kSAHBuckets * ((bounds_of(item).centroid()[split_axis] - extent.min) / extent.size()));
+                b = std::min(std::max(b, 0), kSAHBuckets - 1);
+                return b <= best_bucket;
+            });
+        mid = first_right - items.begin();
+    }
+
+    // Degenerate split (every centroid in the same spot), fall back to halving the range
+    if (mid == start || mid == end)
+        mid = start + (end - start) / 2;
+
+    return mid;
+}
+
+// Node of a flattened hierarchy, 32 bytes so two nodes share a cache line
+// Nodes are stored in depth-first order: the first child of an interior node is the next node
+// in the array and only the second child's index is kept.
+struct linear_bvh_node {
+    float bounds_min[3];    // Box corners, rounded outwards to float
+    float bounds_max[3];
+    uint32_t offset;        // Leaf: first primitive, Interior: index of the second child
+    uint16_t count;         // Number of primitives in a leaf, 0 for interior nodes
+    uint8_t axis;           // Axis an interior node was split along
+    uint8_t pad;
+
+    // Slab test against a ray with precomputed reciprocal direction
+    inline bool hit(const point3& origin, const vec3& inv_dir, const interval& ray_t) const {
+        double tmin = ray_t.min;
+        double tmax = ray_t.max;
+
+        for (int a = 0; a < 3; a++) {
+            double t0 = (bounds_min[a] - origin[a]) * inv_dir[a];
+            double t1 = (bounds_max[a] - origin[a]) * inv_dir[a];
+            if (inv_dir[a] < 0) std::swap(t0, t1);
+
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+        }
+
+        return tmin <= tmax;
+    }
+
+    // Stores a box, rounding each corner outwards so the float box contains the double one
+    void set_bounds(const aabb& box) {
+        for (int a = 0; a < 3; a++) {
+            float lo = static_cast<float>(box.axis(a).min);
+            float hi = static_cast<float>(box.axis(a).max);
+            if (lo > box.axis(a).min) lo = std::nextafter(lo, -std::numeric_limits<float>::infinity());
+            if (hi < box.axis(a).max) hi = std::nextafter(hi, std::numeric_limits<float>::infinity());
+            bounds_min[a] = lo;
+            bounds_max[a] = hi;
+        }
+    }
+
+    aabb bounds() const {
+        return aabb(interval(bounds_min[0], bounds_max[0]),
+                    interval(bounds_min[1], bounds_max[1]),
+                    interval(bounds_min[2], bounds_max[2]));
+    }
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should be 32 bytes");
+
+// Flattened hierarchy over a set of primitive boxes
+// Only stores the tree, the owner keeps the primitives and reorders them with primitive_order()
+// so that every leaf covers a contiguous range.
+class linear_bvh {
+  public:
+    // Traversal stack size, larger than any tree the build can produce
+    static const int kMaxStackDepth = 128;
+
+    // Primitive count from which build() switches to the parallel Morton code builder
+    static const size_t kHLBVHMinPrimitives = 4096;
+
+    std::vector<linear_bvh_node> nodes;
+
+    // Builds the tree, leaves hold at most max_leaf_size primitives
+    // Small sets use the recursive SAH build, large ones the parallel HLBVH build.
+    void build(const std::vector<aabb>& prim_bounds, int max_leaf_size) {
+        auto build_start = std::chrono::steady_clock::now();
+
+        nodes.clear();
+        order.clear();
+
+        if (!prim_bounds.empty()) {
+            max_leaf_size = std::max(max_leaf_size, 1);
+
+            if (prim_bounds.size() >= kHLBVHMinPrimitives) {
+                build_hlbvh(prim_bounds, max_leaf_size);
+            } else {
+                order.reserve(prim_bounds.size());
+                for (size_t i = 0; i < prim_bounds.size(); i++)
+                    order.push_back(static_cast<uint32_t>(i));
+
+                nodes.reserve(2 * prim_bounds.size());
+                build_recursive(prim_bounds, 0, order.size(), 0, max_leaf_size);
+            }
+        }
+
+        link_parents();
+        built_cost = sah_cost();
+        wide.build(nodes, wide_bvh_width());
+
+        auto build_time = std::chrono::steady_clock::now() - build_start;
+        numBVHBuilds.fetch_add(1);
+        bvhBuildMicroseconds.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(build_time).count());
+        bvhSAHCostTotal += built_cost;
+    }
+
+    // Recomputes the boxes above the primitives whose bounds changed, keeping the topology
+    // leaf_bounds holds the bounds of every primitive by leaf position, changed lists the
+    // positions that moved. Only the leaves holding them and their ancestors are touched, and
+    // they are updated in decreasing index order, which is bottom-up for a depth-first layout.
+    void refit(const std::vector<aabb>& leaf_bounds, const std::vector<uint32_t>& changed) {
+        auto refit_start = std::chrono::steady_clock::now();
+
+        refit_marks.resize(nodes.size(), 0);
+        std::vector<uint32_t> dirty;
+
+        for (uint32_t position : changed) {
+            for (uint32_t n = leaf_of[position]; n != kNoParent && !refit_marks[n]; n = parents[n]) {
+                refit_marks[n] = 1;
+                dirty.push_back(n);
+            }
+        }
+
+        std::sort(dirty.begin(), dirty.end(), [](uint32_t a, uint32_t b) { return a > b; });
+
+        for (uint32_t n : dirty) {
+            linear_bvh_node& node = nodes[n];
+            aabb box;
+            if (node.count > 0) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                    box = aabb(box, leaf_bounds[i]);
+            } else {
+                box = aabb(nodes[n + 1].bounds(), nodes[node.offset].bounds());
+            }
+            node.set_bounds(box);
+            refit_marks[n] = 0;
+            if (!wide.empty()) wide.refresh(n, node.bounds());
+        }
+
+        auto refit_time = std::chrono::steady_clock::now() - refit_start;
+        numBVHRefits.fetch_add(1);
+        bvhRefitMicroseconds.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(refit_time).count());
+    }
+
+    // Ratio of the current SAH cost to the cost right after the last build
+    // Refitting keeps the topology, so this grows as primitives drift away from where the
+    // build put them.
+    double degradation() const {
+        return built_cost > 0 ? sah_cost() / built_cost : 1.0;
+    }
+
+    // Surface area heuristic cost of the tree, the expected cost of a random ray relative to one
+    // primitive test: every node costs its area times the traversal cost, every leaf its area
+    // times its primitive count, all relative to the root's area.
+    double sah_cost() const {
+        const double kTraversalCost = 1.0;
+        const double kIntersectionCost = 1.0;
+
+        if (nodes.empty()) return 0.0;
+
+        double root_area = nodes[0].bounds().surface_area();
+        if (root_area <= 0) return 0.0;
+
+        double cost = 0.0;
+        for (const auto& node : nodes) {
+            double area = node.bounds().surface_area() / root_area;
+            cost += node.count > 0 ? area * node.count * kIntersectionCost : area * kTraversalCost;
+        }
+        return cost;
+    }
+
+    // Original index of the primitive stored at each leaf position
+    const std::vector<uint32_t>& primitive_order() const { return order; }
+
+    bool empty() const { return nodes.empty(); }
+
+    // Box around everything in the tree
+    aabb bounds() const { return nodes.empty() ? aabb() : nodes[0].bounds(); }
+
+    // Iterative traversal, nodes are popped from a local stack instead of recursing
+    // leaf_hit(index, ray_t, t) tests the primitive at a leaf position and returns true with its
+    // hit distance in t. The interval shrinks with every hit so later boxes are culled against
+    // the closest hit found so far.
+    template <typename LeafFn>
+    bool intersect(const ray& r, interval ray_t, LeafFn leaf_hit) const {
+        return intersect_leaves(r, ray_t, [&](uint32_t first, uint32_t count, interval t_range, double& t) {
+            bool hit_anything = false;
+            for (uint32_t i = first; i < first + count; i++) {
+                if (leaf_hit(i, t_range, t)) {
+                    hit_anything = true;
+                    t_range.max = t;
+                }
+            }
+            return hit_anything;
+        });
+    }
+
+    // Same traversal, but leaf_hit(first, count, ray_t, t) tests a whole leaf at once, which lets
+    // the owner intersect the primitives of a leaf together
+    // Uses the wide copy of the tree when there is one.
+    template <typename LeafRangeFn>
+    bool intersect_leaves(const ray& r, interval ray_t, LeafRangeFn leaf_hit) const {
+        return traverse<false>(r, ray_t, leaf_hit);
+    }
+
+    // Any-hit traversal for shadow and visibility rays
+    // leaf_hit(index, ray_t) tests the primitive at a leaf position, the traversal returns true
+    // at the first primitive it reports a hit for, without looking for a closer one.
+    template <typename LeafFn>
+    bool occluded(const ray& r, interval ray_t, LeafFn leaf_hit) const {
+        return occluded_leaves(r, ray_t, [&](uint32_t first, uint32_t count, const interval& t_range) {
+            for (uint32_t i = first; i < first + count; i++) {
+                if (leaf_hit(i, t_range))
+                    return true;
+            }
+            return false;
+        });
+    }
+
+    // Same any-hit traversal, leaf_hit(first, count, ray_t) tests a whole leaf at once
+    template <typename LeafRangeFn>
+    bool occluded_leaves(const ray& r, interval ray_t, LeafRangeFn leaf_hit) const {
+        return traverse<true>(r, ray_t, [&](uint32_t first, uint32_t count, const interval& t_range, double& t) {
+            return leaf_hit(first, count, t_range);
+        });
+    }
+
+    // Packet version of intersect_leaves, see wide_bvh::intersect_packet
+    // leaf_hit(k, first, count, ray_t, t) tests ray k against a leaf, ray_t[k] shrinks to the
+    // closest hit of ray k. Returns the mask of rays that hit. Without a wide copy of the tree the
+    // rays are traced one by one.
+    template <typename PacketLeafFn>
+    uint64_t intersect_packet(const ray* rays, interval* ray_t, int count, PacketLeafFn leaf_hit) const {
+        return traverse_packet<false>(rays, ray_t, count, leaf_hit);
+    }
+
+    // Packet version of occluded_leaves, leaf_hit(k, first, count, ray_t) tests ray k against a
+    // leaf; returns the mask of rays that hit something
+    template <typename PacketLeafFn>
+    uint64_t occluded_packet(const ray* rays, interval* ray_t, int count, PacketLeafFn leaf_hit) const {
+        return traverse_packet<true>(rays, ray_t, count, [&](int k, uint32_t first, uint32_t leaf_count, const interval& t_range, double& t) {
+            return leaf_hit(k, first, leaf_count, t_range);
+        });
+    }
+
+  private:
+    template <bool AnyHit, typename PacketLeafFn>
+    uint64_t traverse_packet(const ray* rays, interval* ray_t, int count, PacketLeafFn leaf_hit) const {
+        if (nodes.empty())
+            return 0;
+
+        if (!wide.empty()) {
+            uint64_t visited = 0;
+            uint64_t box_hits = 0;
+            uint64_t hits = AnyHit ? wide.occluded_packet(rays, ray_t, count, leaf_hit, visited, box_hits)
+                                   : wide.intersect_packet(rays, ray_t, count, leaf_hit, visited, box_hits);
+
+            numBVHTraversals.fetch_add(count, std::memory_order_relaxed);
+            numBVHNodeVisits.fetch_add(visited, std::memory_order_relaxed);
+            boundingVolumeIsect.fetch_add(box_hits, std::memory_order_relaxed);
+            return hits;
+        }
+
+        uint64_t hits = 0;
+        for (int k = 0; k < count; k++) {
+            double t = ray_t[k].max;
+            bool hit_anything = traverse<AnyHit>(rays[k], ray_t[k], [&](uint32_t first, uint32_t leaf_count, const interval& t_range, double& leaf_t) {
+                if (!leaf_hit(k, first, leaf_count, t_range, leaf_t)) return false;
+                if (!AnyHit) t = leaf_t;
+                return true;
+            });
+            if (hit_anything) {
+                hits |= 1ull << k;
+                if (!AnyHit) ray_t[k].max = t;
+            }
+        }
+        return hits;
+    }
+
+    // Traversal behind intersect_leaves and occluded_leaves, AnyHit stops at the first hit
+    // instead of shrinking the interval to it
+    template <bool AnyHit, typename LeafRangeFn>
+    bool traverse(const ray& r, interval ray_t, LeafRangeFn leaf_hit) const {
+        if (nodes.empty())
+            return false;
+
+        if (!wide.empty()) {
+            uint64_t visited = 0;
+            uint64_t box_hits = 0;
+            bool hit_anything = AnyHit ? wide.occluded(r, ray_t, leaf_hit, visited, box_hits)
+                                       : wide.intersect(r, ray_t, leaf_hit, visited, box_hits);
+
+            numBVHTraversals.fetch_add(1, std::memory_order_relaxed);
+            numBVHNodeVisits.fetch_add(visited, std::memory_order_relaxed);
+            boundingVolumeIsect.fetch_add(box_hits, std::memory_order_relaxed);
+            return hit_anything;
+        }
+
+        const point3 origin = r.origin();
+        const vec3 dir = r.direction();
+        const vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+
+        bool hit_anything = false;
+        uint64_t visited = 0;
+        uint64_t box_hits = 0;
+
+        uint32_t stack[kMaxStackDepth];
+        int stack_size = 0;
+        uint32_t current = 0;
+
+        while (true) {
+            const linear_bvh_node& node = nodes[current];
+            visited++;
+
+            if (node.hit(origin, inv_dir, ray_t)) {
+                box_hits++;
+
+                if (node.count > 0) {
+                    // Leaf, test its primitives
+                    double t;
+                    if (leaf_hit(node.offset, node.count, ray_t, t)) {
+                        hit_anything = true;
+                        if (AnyHit) break;
+                        ray_t.max = t;
+                    }
+                }
+                else {
+                    // Interior, visit the near child next and save the far one
+                    if (dir[node.axis] < 0) {
+                        stack[stack_size++] = current + 1;
+                        current = node.offset;
+                    } else {
+                        stack[stack_size++] = node.offset;
+                        current = current + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+        }
+
+        numBVHTraversals.fetch_add(1, std::memory_order_relaxed);
+        numBVHNodeVisits.fetch_add(visited, std::memory_order_relaxed);
+        boundingVolumeIsect.fetch_add(box_hits, std::memory_order_relaxed);
+
+        return hit_anything;
+    }
+
+    // Past this depth ranges are split at the median, which bounds the depth of the tree
+    static const int kMaxSAHDepth = 40;
+
+    // Number of high Morton code bits that select the treelet a primitive belongs to
+    static const int kTreeletBits = 12;
+    // Depth after which the upper SAH levels over the treelets split at the median
+    static const int kMaxTreeletSAHDepth = 24;
+
+    // Node of a treelet before it is flattened into the final array
+    struct build_node {
+        aabb bounds;
+        int children[2];        // Indices within the treelet's node list, -1 for leaves
+        uint32_t first;         // First position in order for leaves
+        uint32_t count;         // Primitive count for leaves
+        int axis;
+    };
+
+    // Contiguous run of sorted primitives sharing their top Morton bits, built into its own subtree
+    struct treelet {
+        uint32_t start, count;
+        std::vector<build_node> build_nodes;
+        aabb bounds() const { return build_nodes.empty() ? aabb() : build_nodes[0].bounds; }
+    };
+
+    // Parent index of the root
+    static const uint32_t kNoParent = 0xffffffff;
+
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> parents;      // Parent of every node, used to walk up when refitting
+    std::vector<uint32_t> leaf_of;      // Leaf node holding each primitive position
+    std::vector<uint8_t> refit_marks;   // Scratch flags for refit(), all clear between calls
+    double built_cost = 0.0;            // SAH cost right after the last build
+    wide_bvh wide;                      // 4 or 8 wide copy used for traversal, empty when turned off
+
+    // Fills parents and leaf_of from the node array
+    void link_parents() {
+        const uint32_t none = kNoParent;
+        parents.assign(nodes.size(), none);
+        leaf_of.assign(order.size(), none);
+
+        for (uint32_t n = 0; n < nodes.size(); n++) {
+            const linear_bvh_node& node = nodes[n];
+            if (node.count > 0) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                    leaf_of[i] = n;
+            } else {
+                parents[n + 1] = n;
+                parents[node.offset] = n;
+            }
+        }
+    }
+
+    // Hierarchical linear BVH build (HLBVH)
+    // Centroids are sorted by Morton code with a parallel radix sort, runs that share their top
+    // kTreeletBits bits become treelets that are split on the remaining code bits in parallel, and
+    // the levels above the treelets are built with the binned SAH.
+    void build_hlbvh(const std::vector<aabb>& prim_bounds, int max_leaf_size) {
+        size_t count = prim_bounds.size();
+
+        // 63-bit codes once 10 bits per axis can no longer tell neighbouring primitives apart
+        const int bits_per_axis = count > (1u << 20) ? 21 : 10;
+        const int code_bits = 3 * bits_per_axis;
+
+        aabb centroid_bounds;
+        for (const auto& box : prim_bounds) {
+            point3 c = box.centroid();
+            centroid_bounds = aabb(centroid_bounds, aabb(c, c));
+        }
+
+        // Morton code of every centroid, relative to the centroid bounds
+        std::vector<morton_primitive> morton(count);
+        parallel_for(count, [&](size_t i) {
+            point3 c = prim_bounds[i].centroid();
+            double offset[3];
+            for (int a = 0; a < 3; a++) {
+                const interval& extent = centroid_bounds.axis(a);
+                offset[a] = extent.size() > 0 ? (c[a] - extent.min) / extent.size() : 0.0;
+            }
+            morton[i].code = encode_morton3(offset[0], offset[1], offset[2], bits_per_axis);
+            morton[i].index = static_cast<uint32_t>(i);
+        });
+
+        parallel_radix_sort(morton, code_bits);
+
+        order.resize(count);
+        for (size_t i = 0; i < count; i++)
+            order[i] = morton[i].index;
+
+        // Find the runs that share their top bits
+        const int treelet_shift = code_bits - kTreeletBits;
+        std::vector<treelet> treelets;
+        for (size_t start = 0, end = 1; end <= count; end++) {
+            if (end == count || (morton[start].code >> treelet_shift) != (morton[end].code >> treelet_shift)) {
+                treelet t;
+                t.start = static_cast<uint32_t>(start);
+                t.count = static_cast<uint32_t>(end - start);
+                treelets.push_back(t);
+                start = end;
+            }
+        }
+
+        // Build every treelet on the remaining bits
+        parallel_for(treelets.size(), [&](size_t i) {
+            treelet& t = treelets[i];
+            t.build_nodes.reserve(2 * t.count);
+            emit_lbvh(t.build_nodes, prim_bounds, morton, t.start, t.count, treelet_shift - 1, max_leaf_size);
+        }, 1);
+
+        // Binned SAH over the treelets, which flattens each treelet as it is reached
+        std::vector<uint32_t> treelet_ids(treelets.size());
+        for (size_t i = 0; i < treelets.size(); i++)
+            treelet_ids[i] = static_cast<uint32_t>(i);
+
+        nodes.reserve(2 * count);
+        build_upper(treelets, treelet_ids, 0, treelet_ids.size(), 0);
+    }
+
+    // Splits the sorted primitives [start, start + count) on Morton bit `bit` and below
+    // Returns the index of the emitted node in out.
+    int emit_lbvh(std::vector<build_node>& out, const std::vector<aabb>& prim_bounds,
+                  const std::vector<morton_primitive>& morton, uint32_t start, uint32_t count,
+                  int bit, int max_leaf_size) {
+        // Skip bits that every primitive in the range agrees on
+        while (bit >= 0 && count > static_cast<uint32_t>(max_leaf_size)) {
+            uint64_t mask = 1ull << bit;
+            if ((morton[start].code & mask) != (morton[start + count - 1].code & mask))
+                break;
+            bit--;
+        }
+
+        int index = static_cast<int>(out.size());
+        out.push_back(build_node());
+
+        if (count <= static_cast<uint32_t>(max_leaf_size)) {
+            aabb box;
+            for (uint32_t i = start; i < start + count; i++)
+                box = aabb(box, prim_bounds[morton[i].index]);
+
+            out[index].bounds = box;
+            out[index].children[0] = out[index].children[1] = -1;
+            out[index].first = start;
+            out[index].count = count;
+            out[index].axis = 0;
+            return index;
+        }
+
+        uint32_t split;
+        int axis;
+        if (bit >= 0) {
+            // The higher bits are shared and the range is sorted, so the primitives with the bit
+            // clear come first, binary search for the first one with the bit set
+            uint64_t mask = 1ull << bit;
+            uint32_t lo = start, hi = start + count - 1;
+            while (lo + 1 < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (morton[mid].code & mask)
+                    hi = mid;
+                else
+                    lo = mid;
+            }
+            split = hi - start;
+            axis = bit % 3;
+        } else {
+            // Every code bit is equal, halve the range
+            split = count / 2;
+            axis = 0;
+        }
+
+        int left = emit_lbvh(out, prim_bounds, morton, start, split, bit - 1, max_leaf_size);
+        int right = emit_lbvh(out, prim_bounds, morton, start + split, count - split, bit - 1, max_leaf_size);
+
+        out[index].bounds = aabb(out[left].bounds, out[right].bounds);
+        out[index].children[0] = left;
+        out[index].children[1] = right;
+        out[index].first = 0;
+        out[index].count = 0;
+        out[index].axis = axis;
+        return index;
+    }
+
+    // Builds the levels above treelet_ids[start, end) with the binned SAH, returns the node index
+    uint32_t build_upper(const std::vector<treelet>& treelets, std::vector<uint32_t>& treelet_ids,
+                         size_t start, size_t end, int depth) {
+        if (end - start == 1) {
+            const treelet& t = treelets[treelet_ids[start]];
+            return flatten(t.build_nodes, 0);
+        }
+
+        uint32_t index = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(linear_bvh_node());
+
+        auto bounds_of = [&treelets](uint32_t i) { return treelets[i].bounds(); };
+
+        aabb box;
+        for (size_t i = start; i < end; i++)
+            box = aabb(box, bounds_of(treelet_ids[i]));
+
+        int axis;
+        size_t mid;
+        if (depth < kMaxTreeletSAHDepth) {
+            mid = sah_partition(treelet_ids, start, end, bounds_of, axis);
+        } else {
+            axis = box.longest_axis();
+            mid = start + (end - start) / 2;
+            std::nth_element(treelet_ids.begin() + start, treelet_ids.begin() + mid, treelet_ids.begin() + end,
+                [&](uint32_t a, uint32_t b) {
+                    return bounds_of(a).centroid()[axis] < bounds_of(b).centroid()[axis];
+                });
+        }
+
+        build_upper(treelets, treelet_ids, start, mid, depth + 1);
+        uint32_t second_child = build_upper(treelets, treelet_ids, mid, end, depth + 1);
+
+        nodes[index].set_bounds(box);
+        nodes[index].offset = second_child;
+        nodes[index].count = 0;
+        nodes[index].axis = static_cast<uint8_t>(axis);
+        nodes[index].pad = 0;
+        return index;
+    }
+
+    // Appends a treelet subtree to the node array in depth-first order, returns the node index
+    uint32_t flatten(const std::vector<build_node>& build_nodes, int node) {
+        const build_node& b = build_nodes[node];
+
+        uint32_t index = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(linear_bvh_node());
+        nodes[index].set_bounds(b.bounds);
+        nodes[index].axis = static_cast<uint8_t>(b.axis);
+        nodes[index].pad = 0;
+
+        if (b.children[0] < 0) {
+            nodes[index].offset = b.first;
+            nodes[index].count = static_cast<uint16_t>(b.count);
+        } else {
+            flatten(build_nodes, b.children[0]);
+            uint32_t second_child = flatten(build_nodes, b.children[1]);
+            nodes[index].offset = second_child;
+            nodes[index].count = 0;
+        }
+        return index;
+    }
+
+    // Emits the node for order[start, end) followed by its subtrees, returns the node's index
+    uint32_t build_recursive(const std::vector<aabb>& prim_bounds, size_t start, size_t end,
+                             int depth, int max_leaf_size) {
+        uint32_t index = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(linear_bvh_node());
+
+        aabb box;
+        for (size_t i = start; i < end; i++)
+            box = aabb(box, prim_bounds[order[i]]);
+
+        nodes[index].set_bounds(box);
+        nodes[index].axis = static_cast<uint8_t>(box.longest_axis());
+        nodes[index].pad = 0;
+
+        if (end - start <= static_cast<size_t>(max_leaf_size)) {
+            nodes[index].offset = static_cast<uint32_t>(start);
+            nodes[index].count = static_cast<uint16_t>(end - start);
+            return index;
+        }
+
+        auto bounds_of = [&prim_bounds](uint32_t i) -> const aabb& { return prim_bounds[i]; };
+
+        int axis;
+        size_t mid;
+        if (depth < kMaxSAHDepth) {
+            mid = sah_partition(order, start, end, bounds_of, axis);
+        } else {
+            // Median split along the longest axis
+            axis = box.longest_axis();
+            mid = start + (end - start) / 2;
+            std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+                [&](uint32_t a, uint32_t b) {
+                    return prim_bounds[a].centroid()[axis] < prim_bounds[b].centroid()[axis];
+                });
+        }
+
+        build_recursive(prim_bounds, start, mid, depth + 1, max_leaf_size);
+        uint32_t second_child = build_recursive(prim_bounds, mid, end, depth + 1, max_leaf_size);
+
+        nodes[index].offset = second_child;
+        nodes[index].count = 0;
+        nodes[index].axis = static_cast<uint8_t>(axis);
+        return index;
+    }
+};
+
+// Scene level hierarchy over a list of hittables using the flattened layout
+// Interior nodes are plain array entries, so the only virtual calls left are the primitive tests
+// in the leaves. The hierarchy can be kept across animation frames with update(), which refits
+// it when only object bounds changed.
+class bvh_scene : public hittable {
+  public:
+    bool   refit_enabled     = true;   // Refit instead of rebuilding when only boxes moved
+    double rebuild_threshold = 1.25;   // SAH cost growth, relative to the last build, that forces a rebuild
+
+    bvh_scene() {}
+
+    bvh_scene(const hittable_list& list) { rebuild(list); }
+
+    // Brings the hierarchy up to date with the list
+    // If the list holds the same objects as last time, only the leaves of objects whose bounding
+    // box changed and their ancestors are refit. Any other change, or a refit that made the tree
+    // too much worse, rebuilds it from scratch.
+    void update(const hittable_list& list) {
+        if (!refit_enabled || list.objects != source) {
+            rebuild(list);
+            return;
+        }
+
+        std::vector<uint32_t> changed;
+        for (size_t i = 0; i < source.size(); i++) {
+            uint32_t position = position_of[i];
+            aabb box = source[i]->bounding_box();
+            if (!same_box(box, leaf_bounds[position])) {
+                leaf_bounds[position] = box;
+                changed.push_back(position);
+            }
+        }
+
+        if (changed.empty())
+            return;
+
+        tree.refit(leaf_bounds, changed);
+
+        if (tree.degradation() > rebuild_threshold)
+            rebuild(list);
+    }
+
+    // Traverses with the objects' intersect() and evaluates the surface of the closest hit alone
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        uint32_t closest = 0;
+
+        uint64_t* touched = primitive_recorder();
+        bool hit_anything = tree.intersect(r, ray_t, [&](uint32_t i, const interval& t_range, double& t) {
+            if (touched != nullptr)
+                touched[i >> 6] |= 1ull << (i & 63);
+            if (!objects[i]->intersect(r, t_range, rec))
+                return false;
+            closest = i;
+            t = rec.t;
+            return true;
+        });
+
+        if (touched != nullptr)
+            record_footprint(r, ray_t.min, hit_anything ? rec.t : ray_t.max);
+        if (!hit_anything)
+            return false;
+
+        objects[closest]->surface_interaction(r, rec);
+        rec.primitive = closest;
+        return true;
+    }
+
+    // Records the objects it tests like hit(), the ones past the first blocker are not tested
+    // The whole segment goes into the footprint, as an object anywhere on it may block it.
+    bool occluded(const ray& r, interval ray_t) const override {
+        uint64_t* touched = primitive_recorder();
+        if (touched != nullptr)
+            record_footprint(r, ray_t.min, ray_t.max);
+        return tree.occluded(r, ray_t, [&](uint32_t i, const interval& t_range) {
+            if (touched != nullptr)
+                touched[i >> 6] |= 1ull << (i & 63);
+            return objects[i]->occluded(r, t_range);
+        });
+    }
+
+    // Traces the packet through the hierarchy together, see linear_bvh::intersect_packet, and
+    // evaluates the surface of each ray's closest hit alone
+    uint64_t hit_packet(const ray* rays, const interval* ray_t, int count, hit_record* recs,
+                        pixel_sampler* samplers) const override {
+        interval t_range[kMaxPacketRays];
+        uint32_t closest[kMaxPacketRays];
+        std::copy(ray_t, ray_t + count, t_range);
+
+        uint64_t* touched = primitive_recorder();
+        uint64_t hits = tree.intersect_packet(rays, t_range, count,
+            [&](int k, uint32_t first, uint32_t leaf_count, interval leaf_t, double& t) {
+                if (samplers != nullptr) thread_sampler() = samplers[k];
+                bool hit_anything = false;
+                for (uint32_t i = first; i < first + leaf_count; i++) {
+                    if (touched != nullptr)
+                        touched[i >> 6] |= 1ull << (i & 63);
+                    if (!objects[i]->intersect(rays[k], leaf_t, recs[k]))
+                        continue;
+                    hit_anything = true;
+                    closest[k] = i;
+                    t = recs[k].t;
+                    leaf_t.max = t;
+                }
+                if (samplers != nullptr) samplers[k] = thread_sampler();
+                return hit_anything;
+            });
+
+        for (int k = 0; k < count; k++) {
+            if (touched != nullptr)
+                record_footprint(rays[k], ray_t[k].min, (hits >> k & 1) ? recs[k].t : ray_t[k].max);
+            if (!(hits >> k & 1)) continue;
+            objects[closest[k]]->surface_interaction(rays[k], recs[k]);
+            recs[k].primitive = closest[k];
+        }
+        return hits;
+    }
+
+    uint64_t occluded_packet(const ray* rays, const interval* ray_t, int count, pixel_sampler* samplers) const override {
+        interval t_range[kMaxPacketRays];
+        std::copy(ray_t, ray_t + count, t_range);
+
+        uint64_t* touched = primitive_recorder();
+        for (int k = 0; k < count && touched != nullptr; k++)
+            record_footprint(rays[k], ray_t[k].min, ray_t[k].max);
+        return tree.occluded_packet(rays, t_range, count, [&](int k, uint32_t first, uint32_t leaf_count, const interval& leaf_t) {
+            if (samplers != nullptr) thread_sampler() = samplers[k];
+            bool blocked = false;
+            for (uint32_t i = first; i < first + leaf_count && !blocked; i++) {
+                if (touched != nullptr)
+                    touched[i >> 6] |= 1ull << (i & 63);
+                blocked = objects[i]->occluded(rays[k], leaf_t);
+            }
+            if (samplers != nullptr) samplers[k] = thread_sampler();
+            return blocked;
+        });
+    }
+
+    aabb bounding_box() const override { return tree.bounds(); }
+
+    // Hashes the objects in the order of the list the hierarchy was made from, which does not
+    // depend on how the tree was built
+    void hash_state(state_hasher& h) const override {
+        h.add("bvh_scene");
+        h.add(static_cast<uint64_t>(source.size()));
+        for (const auto& object : source)
+            object->hash_state(h);
+    }
+
+    // Lists the objects in leaf order, the order hit() records their tests in
+    void collect_primitives(std::vector<const hittable*>& primitives) const override {
+        for (const auto& object : objects)
+            primitives.push_back(object.get());
+    }
+
+    // Collects the lights of the objects in the hierarchy
+    void collect_lights(std::vector<const hittable*>& lights) const override {
+        for (const auto& object : objects)
+            object->collect_lights(lights);
+    }
+
+    bool hits_at_random() const override {
+        for (const auto& object : objects)
+            if (object->hits_at_random()) return true;
+        return false;
+    }
+
+  private:
+    // Leaves hold at most this many objects
+    static const int kMaxLeafSize = 2;
+
+    linear_bvh tree;                                // Flattened hierarchy
+    std::vector<shared_ptr<hittable>> objects;      // Objects in leaf order
+    std::vector<shared_ptr<hittable>> source;       // Objects in the order of the list they came from
+    std::vector<uint32_t> position_of;              // Leaf position of each source object
+    std::vector<aabb> leaf_bounds;                  // Bounds of each object when the tree was last fit
+
+    void rebuild(const hittable_list& list) {
+        source = list.objects;
+
+        std::vector<aabb> prim_bounds;
+        prim_bounds.reserve(source.size());
+        for (const auto& object : source)
+            prim_bounds.push_back(object->bounding_box());
+
+        tree.build(prim_bounds, kMaxLeafSize);
+
+        // Store the objects in leaf order
+        const std::vector<uint32_t>& order = tree.primitive_order();
+        objects.clear();
+        leaf_bounds.clear();
+        position_of.assign(source.size(), 0);
+        for (uint32_t position = 0; position < order.size(); position++) {
+            objects.push_back(source[order[position]]);
+            leaf_bounds.push_back(prim_bounds[order[position]]);
+            position_of[order[position]] = position;
+        }
+    }
+
+    static bool same_box(const aabb& a, const aabb& b) {
+        return a.x.min == b.x.min && a.x.max == b.x.max
+            && a.y.min == b.y.min && a.y.max == b.y.max
+            && a.z.min == b.z.min && a.z.max == b.z.max;
+    }
+};
+
+#endif
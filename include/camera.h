@@ -4,6 +4,39 @@
 #include "main.h"
 #include "material.h"
 
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// What the denoiser is guided by: albedo and normal of the first surface a camera ray sees
+// through mirrors and glass
+struct surface_features {
+    color albedo;
+    vec3 normal;
+};
+
+// Rays camera::ray_color traced through the scene on one thread, and the time spent on them
+// Camera rays count as primary, scattered and shadow rays as secondary; camera rays tested
+// against a known first object are not counted.
+struct ray_counts {
+    uint64_t primary_rays = 0;
+    double primary_seconds = 0.0;
+    uint64_t secondary_rays = 0;
+    double secondary_seconds = 0.0;
+
+    void add(const ray_counts& other) {
+        primary_rays += other.primary_rays;
+        primary_seconds += other.primary_seconds;
+        secondary_rays += other.secondary_rays;
+        secondary_seconds += other.secondary_seconds;
+    }
+};
+
+inline ray_counts& thread_ray_counts() {
+    static thread_local ray_counts counts;
+    return counts;
+}
+
 // Camera class responsible for generating rays cast into the scene and determines color returned by rays
 class camera {
     public: 
@@ -11,8 +44,15 @@ class camera {
         int    image_width       = 100;  // Rendered image width in pixels
         int    samples_per_pixel = 10;   // Count of random samples for each pixel (anti-aliasing)
         int    max_depth         = 10;   // Maximum number of ray bounces into scene (ray bounce recursion depth)
+        int    roulette_depth    = 3;    // Bounces before paths may be ended by Russian roulette
+        int    record_depth      = 0;    // Bounces whose rays, and shadow rays, primitive_recorder() records, 0 for all
         color  background;               // Scene background color       
 
+        // Dimensions of a sample used by the camera ray: pixel position (0, 1), lens (2, 3), time (4)
+        static const int kCameraDimensions = 6;
+        // Dimensions of a sample used by each bounce: media along the ray (0), scattering (2-4),
+        // light choice (5), point on the light (6, 7), media along the shadow ray (8), roulette (9)
+        static const int kBounceDimensions = 10;
 
     public: 
         // Camera constructor
@@ -68,35 +108,214 @@ class camera {
             );
         }
 
+        // Ray through s, t from the center of the lens at the start of the shutter, the same for
+        // every sample
+        ray get_center_ray(double s, double t) const {
+            return ray(origin, lower_left_corner + s*horizontal + t*vertical - origin, 0.0);
+        }
+
+        // Image plane position s, t a point is seen at through the center of the lens, the
+        // inverse of get_center_ray. False for points behind the camera.
+        bool project(const point3& p, double& s, double& t) const {
+            vec3 d = p - origin;
+            double focus_dist = -dot(lower_left_corner - origin, w);
+            double depth = -dot(d, w);
+            if (depth <= 0) return false;
+
+            vec3 on_plane = origin + d * (focus_dist / depth) - lower_left_corner;
+            s = dot(on_plane, horizontal) / horizontal.length_squared();
+            t = dot(on_plane, vertical) / vertical.length_squared();
+            return true;
+        }
+
+        // Whether other sees the scene exactly as this camera does, so every ray it traces is the same
+        bool same_view(const camera& other) const {
+            return (origin - other.origin).length_squared() == 0 &&
+                   (lower_left_corner - other.lower_left_corner).length_squared() == 0 &&
+                   (horizontal - other.horizontal).length_squared() == 0 &&
+                   (vertical - other.vertical).length_squared() == 0 &&
+                   lens_radius == other.lens_radius &&
+                   (background - other.background).length_squared() == 0 &&
+                   roulette_depth == other.roulette_depth;
+        }
+
+        // Adds everything the rays and the background depend on to a scene hash
+        void hash_state(state_hasher& h) const {
+            h.add("camera");
+            h.add(origin);
+            h.add(lower_left_corner);
+            h.add(horizontal);
+            h.add(vertical);
+            h.add(lens_radius);
+            h.add(background);
+            h.add(roulette_depth);
+        }
+
         // Given a ray and a list of hittable objects, calculates the color that the ray should return
         // after interacting with the objects in the list.
         // Implements the core ray-color computation logic of ray tracing, considering ray bounces, material emissions, and scatters.
-        color ray_color(const ray& r, const hittable& world, int depth) const {
-            hit_record rec;
+        // The path is followed in a loop that carries the product of the attenuations so far
+        // (throughput) instead of recursing. At non-specular surfaces one of the lights is also
+        // sampled directly (next event estimation). A light can then be found both ways, so both
+        // estimates are weighted with the power heuristic: scatter_pdf is the density with which
+        // the previous hit picked the ray, 0 for camera rays and specular bounces, which light
+        // sampling cannot reproduce.
+        // If features is given, it receives the albedo and normal of the first diffuse or glossy
+        // surface, tinted by the mirrors and glass in front of it.
+        // If first_object is given, the camera ray is tested against it alone: the caller knows
+        // it is what the ray hits first.
+        color ray_color(const ray& camera_ray, const hittable& world, const std::vector<const hittable*>& lights,
+                        int max_depth, surface_features* features = nullptr,
+                        const hittable* first_object = nullptr) const {
+            color radiance(0,0,0);
+            color throughput(1,1,1);
+            ray r = camera_ray;
+            double scatter_pdf = 0.0;
+            int depth = 0;
+            bool features_found = features == nullptr;
+            if (features != nullptr) {
+                features->albedo = color(0,0,0);
+                features->normal = vec3(0,0,0);
+            }
 
             // If we've exceeded the ray bounce limit, no more light is gathered.
-            if (depth <= 0)
+            while (depth < max_depth) {
+                hit_record rec;
+                uint32_t dimension = kCameraDimensions + depth * kBounceDimensions;
+                if (depth == record_depth && depth > 0)
+                    primitive_recorder() = nullptr;
+                depth++;
+
+                // Every bounce draws from its own dimensions, so the samples of a pixel stay
+                // stratified at each bounce whatever the earlier bounces drew
+                seek_sample_dimension(dimension);
+
+                // If the ray hits nothing, add the background color.
+                bool cached = depth == 1 && first_object != nullptr;
+                auto trace_start = std::chrono::steady_clock::now();
+                bool found = (cached ? *first_object : world).hit(r, interval(0.001, infinity), rec);
+                if (!cached) {
+                    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - trace_start).count();
+                    ray_counts& counts = thread_ray_counts();
+                    (depth == 1 ? counts.primary_rays : counts.secondary_rays)++;
+                    (depth == 1 ? counts.primary_seconds : counts.secondary_seconds) += seconds;
+                }
+                if (!found) {
+                    radiance += throughput * background;
+                    if (!features_found)
+                        features->albedo = throughput * background;
+                    break;
+                }
+
+                if (!features_found) {
+                    features->albedo = throughput * rec.mat()->surface_albedo(rec);
+                    features->normal = rec.normal;
+                    features_found = !rec.mat()->is_specular();
+                }
+
+                // Add the emission of what was hit
+                color color_from_emission = rec.mat()->emitted(rec.u, rec.v, rec.p);
+                if (scatter_pdf > 0 && is_sampled_light(rec.object, lights)) {
+                    double light_pdf = rec.object->light_pdf(r, rec) / lights.size();
+                    color_from_emission = color_from_emission * power_heuristic(scatter_pdf, light_pdf);
+                }
+                radiance += throughput * color_from_emission;
+
+                // Mirrors and glass only find lights through the scattered ray
+                // The light sample is taken whether or not the material scatters the ray, as the
+                // MIS weights count on it for every hit; a scatter that fails (a fuzzy reflection
+                // below the surface) only ends the path.
+                bool sample_lights = !lights.empty() && !rec.mat()->is_specular();
+                if (sample_lights) {
+                    seek_sample_dimension(dimension + 5);
+                    radiance += throughput * sample_light(r, rec, world, lights);
+                }
+
+                // Check if the ray is scattered by the material of the hit object
+                ray scattered;
+                color attenuation;
+                seek_sample_dimension(dimension + 2);
+                if (!rec.mat()->scatter(r, rec, attenuation, scattered))
+                    break;
+
+                scatter_pdf = sample_lights ? rec.mat()->pdf(r, rec, scattered.direction()) : 0.0;
+                throughput = throughput * attenuation;
+                r = scattered;
+
+                // Russian roulette: past roulette_depth a path survives with a probability that
+                // follows its throughput, and survivors are scaled up to keep the estimate unbiased
+                if (depth >= roulette_depth) {
+                    seek_sample_dimension(dimension + 9);
+                    double survival = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 0.95);
+                    if (random_double() >= survival)
+                        break;
+                    throughput /= survival;
+                }
+            }
+
+            numPathSegments.fetch_add(depth, std::memory_order_relaxed);
+            return radiance;
+        }
+
+        // Light arriving at a hit point straight from a random point on a random light
+        // The light's solid angle density (divided by the number of lights) weights the sample,
+        // and an occlusion ray towards the point decides if the light is visible.
+        color sample_light(const ray& r, const hit_record& rec, const hittable& world,
+                           const std::vector<const hittable*>& lights) const {
+            ray shadow;
+            interval shadow_t;
+            color light;
+            if (!light_sample(r, rec, lights, shadow, shadow_t, light))
+                return color(0,0,0);
+
+            // Anything between the hit point and the light blocks it
+            auto trace_start = std::chrono::steady_clock::now();
+            bool blocked = world.occluded(shadow, shadow_t);
+            ray_counts& counts = thread_ray_counts();
+            counts.secondary_rays++;
+            counts.secondary_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - trace_start).count();
+            if (blocked)
                 return color(0,0,0);
 
-            // If the ray hits nothing, return the background color.
-            if (!world.hit(r, interval(0.001, infinity), rec))
-                return background;
+            return light;
+        }
+
+        // sample_light() without the occlusion test, for callers that trace the shadow rays
+        // themselves
+        // Returns false when the sample adds nothing; otherwise light is what it adds unless the
+        // shadow ray is blocked within shadow_t.
+        bool light_sample(const ray& r, const hit_record& rec, const std::vector<const hittable*>& lights,
+                          ray& shadow, interval& shadow_t, color& light) const {
+            const hittable& chosen = *lights[random_int(0, static_cast<int>(lights.size()) - 1)];
 
-            // Check if the ray is scattered by the material of the hit object
-            // If not, it returns the emission color
-            ray scattered;
-            color attenuation;
-            color color_from_emission = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+            shadow = ray(rec.p, unit_vector(chosen.random(rec.p)), r.time());
+            hit_record light_rec;
+            if (!chosen.hit(shadow, interval(0.001, infinity), light_rec))
+                return false;
 
-            if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-                return color_from_emission;
+            double pdf = chosen.light_pdf(shadow, light_rec) / lights.size();
+            color f = rec.mat()->eval(r, rec, shadow.direction());
+            if (pdf <= 0 || (f.x() <= 0 && f.y() <= 0 && f.z() <= 0))
+                return false;
 
+            shadow_t = interval(0.001, light_rec.t - 0.001);
+            double weight = power_heuristic(pdf, rec.mat()->pdf(r, rec, shadow.direction()));
+            light = f * light_rec.mat()->emitted(light_rec.u, light_rec.v, light_rec.p) * (weight / pdf);
+            return true;
+        }
 
-            // If the ray does scatter, it calculates the color resulting from that scattering, 
-            // combining the scattered color with any emitted color.
-            color color_from_scatter = attenuation * ray_color(scattered, world, depth-1);
+        // Multiple importance sampling weight of a sample taken with density pdf when another
+        // technique could have produced it with density other_pdf
+        static double power_heuristic(double pdf, double other_pdf) {
+            double a = pdf * pdf;
+            double b = other_pdf * other_pdf;
+            return a + b > 0 ? a / (a + b) : 0.0;
+        }
 
-            return color_from_emission + color_from_scatter;
+        // Whether object is one of the lights that are sampled directly
+        static bool is_sampled_light(const hittable* object, const std::vector<const hittable*>& lights) {
+            return object != nullptr && object->is_light() &&
+                   std::find(lights.begin(), lights.end(), object) != lights.end();
         }
 
     private:
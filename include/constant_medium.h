@@ -15,16 +15,56 @@ class constant_medium : public hittable {
   public:
   	// Constructor takes a hittable object that represents the boundary, a density, and a texture
     constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a)
-      : boundary(b), neg_inv_density(-1/d), phase_function(make_shared<isotropic>(a))
+      : boundary(b), neg_inv_density(-1/d), phase_function(scene_materials().add(make_shared<isotropic>(a)))
     {}
 
 	// Constructor that takes a hittable, a density, and a color
     constant_medium(shared_ptr<hittable> b, double d, color c)
-      : boundary(b), neg_inv_density(-1/d), phase_function(make_shared<isotropic>(c))
+      : boundary(b), neg_inv_density(-1/d), phase_function(scene_materials().add(make_shared<isotropic>(c)))
     {}
 
 	// Determines if a ray intersects with the medium
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!scatter_distance(r, ray_t, rec.t))
+            return false;
+
+		// Calculate the hit point rec.p inside the medium.
+        rec.p = r.at(rec.t);
+
+		// Set arbitrary values for the hit normal and front face
+		// Assigns the phase function as the material of the hit point.
+        rec.normal = vec3(1,0,0);  
+        rec.front_face = true;     
+        rec.material_id = phase_function;
+        rec.object = this;
+
+		// There was a hit within the medium
+        return true;
+    }
+
+	// A ray is blocked where hit() would scatter it, the random distance is drawn the same way
+    bool occluded(const ray& r, interval ray_t) const override {
+        double t;
+        return scatter_distance(r, ray_t, t);
+    }
+
+	// Return the bounding box of the boundary object
+    aabb bounding_box() const override { return boundary->bounding_box(); }
+
+	// The distance a ray goes into the medium before it scatters is random
+    bool hits_at_random() const override { return true; }
+
+    void hash_state(state_hasher& h) const override {
+        h.add("constant_medium");
+        h.add(neg_inv_density);
+        boundary->hash_state(h);
+        scene_materials()[phase_function]->hash_state(h);
+    }
+
+  private:
+	// Picks the random distance along the ray at which the medium scatters it
+	// Returns false if the ray leaves the medium, or the interval, before it gets there.
+    bool scatter_distance(const ray& r, interval ray_t, double& t) const {
 
         // Print occasional samples when debugging. To enable, set enableDebug true.
         const bool enableDebug = false;
@@ -66,36 +106,24 @@ class constant_medium : public hittable {
         if (hit_distance > distance_inside_boundary)
             return false;
 
-		// Calculate the hit point rec.p and time rec.t inside the medium.
-        rec.t = rec1.t + hit_distance / ray_length;
-        rec.p = r.at(rec.t);
+		// Calculate the time t inside the medium.
+        t = rec1.t + hit_distance / ray_length;
 
         if (debugging) {
             std::clog << "hit_distance = " <<  hit_distance << '\n'
-                      << "rec.t = " <<  rec.t << '\n'
-                      << "rec.p = " <<  rec.p << '\n';
+                      << "rec.t = " <<  t << '\n'
+                      << "rec.p = " <<  r.at(t) << '\n';
         }
 
-		// Set arbitrary values for the hit normal and front face
-		// Assigns the phase function as the material of the hit point.
-        rec.normal = vec3(1,0,0);  
-        rec.front_face = true;     
-        rec.mat_ptr = phase_function;
-
-		// There was a hit within the medium
         return true;
     }
 
-	// Return the bounding box of the boundary object
-    aabb bounding_box() const override { return boundary->bounding_box(); }
-
-  private:
 	// Shared ptr to the boundary object of the medium
     shared_ptr<hittable> boundary;
 	// Store the medium's density's negative inverse
     double neg_inv_density;
-	// The material that describes how rays scatter within the medium
-    shared_ptr<material> phase_function;
+	// Handle of the material that describes how rays scatter within the medium
+    uint32_t phase_function;
 };
 
 #endif
\ No newline at end of file
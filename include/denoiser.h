@@ -0,0 +1,132 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al.), guided by albedo and normal buffers
+// The color is divided by the albedo first, so textures are not blurred and only the lighting
+// is filtered. Each pass averages a 5x5 B3 spline kernel whose taps are 2^pass pixels apart,
+// so five passes cover 125 x 125 pixels at 25 taps per pixel each. Taps are weighted down when
+// their normal or albedo differ from the center, or their lighting differs by more than the
+// pixel's noise explains: the luminance variance of each pixel is filtered alongside its color
+// and scales the luminance edge stopping (as in SVGF, Schied et al.).
+class denoiser {
+  public:
+    int iterations = 5;             // Filter passes
+    double sigma_normal = 128.0;    // Exponent of the normals' cosine, higher keeps sharper creases
+    double sigma_albedo = 0.1;      // Albedo difference that lowers a tap's weight to 1/e
+    double sigma_luminance = 4.0;   // Lighting difference, in standard deviations, that lowers a tap's weight to 1/e
+
+    // Filters a linear rgb image in place, all buffers hold one value per pixel, top row first
+    // color, albedo and normal are rgb / xyz triples, variance is the variance of the mean
+    // luminance of each pixel.
+    void apply(std::vector<float>& color, const std::vector<float>& albedo, const std::vector<float>& normal,
+               const std::vector<float>& variance, int width, int height) const {
+        size_t pixels = static_cast<size_t>(width) * height;
+        if (pixels == 0) return;
+
+        // Lighting: the color divided by the albedo, black and near black albedo is left alone
+        std::vector<float> divisor(3 * pixels);
+        std::vector<float> light(3 * pixels);
+        std::vector<float> light_variance(pixels);
+        parallel_for(pixels, [&](size_t p) {
+            for (int c = 0; c < 3; c++) {
+                divisor[3 * p + c] = albedo[3 * p + c] > kMinAlbedo ? albedo[3 * p + c] : 1.0f;
+                light[3 * p + c] = color[3 * p + c] / divisor[3 * p + c];
+            }
+            float y = luminance(&divisor[3 * p]);
+            light_variance[p] = variance[p] / (y * y);
+        });
+
+        std::vector<float> next_light(3 * pixels);
+        std::vector<float> next_variance(pixels);
+        for (int pass = 0; pass < iterations; pass++) {
+            int step = 1 << pass;
+            parallel_for(static_cast<size_t>(height), [&](size_t row) {
+                for (int x = 0; x < width; x++)
+                    filter_pixel(x, static_cast<int>(row), step, width, height, light, light_variance,
+                                 albedo, normal, next_light, next_variance);
+            }, 8);
+            light.swap(next_light);
+            light_variance.swap(next_variance);
+        }
+
+        parallel_for(3 * pixels, [&](size_t k) { color[k] = light[k] * divisor[k]; });
+    }
+
+  private:
+    static constexpr float kMinAlbedo = 0.01f;
+
+    static float luminance(const float* rgb) {
+        return 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2];
+    }
+
+    // One a-trous tap set around pixel (x, y), writes the filtered lighting and its variance
+    void filter_pixel(int x, int y, int step, int width, int height,
+                      const std::vector<float>& light, const std::vector<float>& light_variance,
+                      const std::vector<float>& albedo, const std::vector<float>& normal,
+                      std::vector<float>& out_light, std::vector<float>& out_variance) const {
+        static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+        size_t p = static_cast<size_t>(y) * width + x;
+        const float* lp = &light[3 * p];
+        const float* ap = &albedo[3 * p];
+        const float* np = &normal[3 * p];
+        float yp = luminance(lp);
+        float luminance_scale = static_cast<float>(sigma_luminance) * std::sqrt(std::max(light_variance[p], 0.0f)) + 1e-6f;
+        float albedo_scale = static_cast<float>(1.0 / (sigma_albedo * sigma_albedo));
+        float normal_power = static_cast<float>(sigma_normal);
+
+        float sum[3] = {0.0f, 0.0f, 0.0f};
+        float sum_variance = 0.0f;
+        float sum_weight = 0.0f;
+
+        for (int dy = -2; dy <= 2; dy++) {
+            int qy = y + dy * step;
+            if (qy < 0 || qy >= height) continue;
+
+            for (int dx = -2; dx <= 2; dx++) {
+                int qx = x + dx * step;
+                if (qx < 0 || qx >= width) continue;
+
+                size_t q = static_cast<size_t>(qy) * width + qx;
+                float weight = kernel[dx + 2] * kernel[dy + 2];
+
+                // The center always counts fully, also where there is no surface to compare
+                if (q != p) {
+                    const float* lq = &light[3 * q];
+                    const float* aq = &albedo[3 * q];
+                    const float* nq = &normal[3 * q];
+
+                    // Surfaces facing away from each other do not share light
+                    float cosine = np[0] * nq[0] + np[1] * nq[1] + np[2] * nq[2];
+                    if (cosine <= 0.0f) continue;
+
+                    float albedo_distance = (ap[0] - aq[0]) * (ap[0] - aq[0]) + (ap[1] - aq[1]) * (ap[1] - aq[1]) +
+                                            (ap[2] - aq[2]) * (ap[2] - aq[2]);
+                    float luminance_distance = std::fabs(yp - luminance(lq));
+
+                    // cosine^sigma_normal * exp(-albedo term) * exp(-luminance term) in one exp
+                    weight *= std::exp(normal_power * std::log(std::min(cosine, 1.0f)) -
+                                       albedo_distance * albedo_scale - luminance_distance / luminance_scale);
+                }
+
+                sum[0] += weight * light[3 * q];
+                sum[1] += weight * light[3 * q + 1];
+                sum[2] += weight * light[3 * q + 2];
+                sum_variance += weight * weight * light_variance[q];
+                sum_weight += weight;
+            }
+        }
+
+        for (int c = 0; c < 3; c++)
+            out_light[3 * p + c] = sum[c] / sum_weight;
+        out_variance[p] = sum_variance / (sum_weight * sum_weight);
+    }
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef FRAME_CACHE_H
+#define FRAME_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// Rendered frames on disk, each in a file named by the hash of the scene and settings that
+// produced it
+// A frame is written to a temporary file and renamed into place, so a run that is stopped
+// halfway never leaves a partial frame behind for the next run to load.
+class frame_cache {
+  public:
+    std::string directory;      // Where the frames are kept, the cache is off while it is empty
+
+    bool enabled() const { return !directory.empty(); }
+
+    // Reads the frame stored under key into pixels, false if there is none of this size
+    bool load(uint64_t key, int width, int height, std::vector<float>& pixels) const {
+        std::ifstream in(path(key), std::ios::binary);
+        if (!in) return false;
+
+        uint32_t header[4];
+        if (!in.read(reinterpret_cast<char*>(header), sizeof(header))) return false;
+        if (header[0] != kMagic || header[1] != kVersion ||
+            header[2] != static_cast<uint32_t>(width) || header[3] != static_cast<uint32_t>(height))
+            return false;
+
+        std::vector<float> stored(static_cast<size_t>(width) * height * 3);
+        if (!in.read(reinterpret_cast<char*>(stored.data()), stored.size() * sizeof(float))) return false;
+        pixels.swap(stored);
+        return true;
+    }
+
+    // Writes a frame of linear rgb floats under key
+    void store(uint64_t key, int width, int height, const std::vector<float>& pixels) const {
+        make_directory();
+
+        std::string final_path = path(key);
+        std::string temporary_path = final_path + ".tmp";
+        {
+            std::ofstream out(temporary_path, std::ios::binary | std::ios::trunc);
+            if (!out) return;
+            uint32_t header[4] = {kMagic, kVersion, static_cast<uint32_t>(width), static_cast<uint32_t>(height)};
+            out.write(reinterpret_cast<const char*>(header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(pixels.data()), pixels.size() * sizeof(float));
+            if (!out) return;
+        }
+        std::remove(final_path.c_str());
+        std::rename(temporary_path.c_str(), final_path.c_str());
+    }
+
+  private:
+    enum : uint32_t {
+        kMagic = 0x43465452,    // "RTFC"
+        kVersion = 1
+    };
+
+    std::string path(uint64_t key) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.frame", static_cast<unsigned long long>(key));
+        return directory + "/" + name;
+    }
+
+    void make_directory() const {
+#ifdef _WIN32
+        _mkdir(directory.c_str());
+#else
+        mkdir(directory.c_str(), 0755);
+#endif
+    }
+};
+
+#endif
@@ -4,16 +4,25 @@
 #include "ray.h"
 #include "main.h"
 #include "aabb.h"
+#include "state_hash.h"
+#include "material_table.h"
 #include <optional>
+#include <type_traits>
+#include <vector>
 
 
 class material;
+class hittable;
 
 // Stores data related to ray-object hits
+// Plain data, copying a record never touches a reference count.
 struct hit_record {
     point3 p;                       // point at which a ray hits an object
     vec3 normal;                    // Normal vector at hit point
-    shared_ptr<material> mat_ptr;   // Shared ptr to hit object material
+    uint32_t material_id = 0;       // Handle of the hit object's material in scene_materials()
+    const hittable* object = nullptr; // Primitive that was hit, tells lights apart for light sampling
+    uint32_t primitive = 0;         // Position of the hit object in the scene's collect_primitives() list
+    uint32_t element = 0;           // Part of the object that was hit, the triangle of a mesh
     double t;                       // ray parameter at which the hit occurred
     double u;                       // text coord u
     double v;                       // text coord v
@@ -24,8 +33,23 @@ struct hit_record {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
+
+    // Material of the hit object
+    const material* mat() const { return scene_materials()[material_id]; }
 };
 
+static_assert(std::is_trivially_copyable<hit_record>::value, "hit_record should stay plain data");
+
+// Bitset of the primitives the current thread's rays are tested against, nullptr when nothing
+// records them. Bit i stands for the i-th primitive listed by the scene's collect_primitives().
+inline uint64_t*& primitive_recorder() {
+    static thread_local uint64_t* bits = nullptr;
+    return bits;
+}
+
+// Most rays hittable::hit_packet() and occluded_packet() take at once, one bit of a mask each
+const int kMaxPacketRays = 64;
+
 // Abstract base class representing objects that can be intersected by rays
 class hittable {
     public: 
@@ -36,6 +60,49 @@ class hittable {
         // Determines if a ray hits the object within a specified interval
         virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
 
+        // Closest hit split in two stages, so a hierarchy only evaluates the surface of the hit
+        // that ends up closest
+        // intersect() finds the closest hit and fills in at least t and object, writing nothing
+        // when there is none. surface_interaction() then fills in the rest of the record for
+        // the hit intersect() found, given the same ray. Objects that do not split the work find
+        // the whole record in intersect().
+        virtual bool intersect(const ray& r, interval ray_t, hit_record& rec) const {
+            return hit(r, ray_t, rec);
+        }
+
+        virtual void surface_interaction(const ray& r, hit_record& rec) const {}
+
+        // Whether anything of the object lies on the ray within the interval
+        // Returns at the first intersection found, without looking for the closest one or
+        // filling in a hit record, for shadow and visibility rays.
+        virtual bool occluded(const ray& r, interval ray_t) const = 0;
+
+        // Closest hits of a packet of up to kMaxPacketRays rays
+        // Bit k of the result is set when ray k hits within ray_t[k], with its record in recs[k].
+        // samplers, unless it is nullptr, holds the random sequence of each ray, swapped into
+        // thread_sampler() while the ray is tested. The rays are traced one by one by default.
+        virtual uint64_t hit_packet(const ray* rays, const interval* ray_t, int count, hit_record* recs,
+                                    pixel_sampler* samplers) const {
+            uint64_t hits = 0;
+            for (int k = 0; k < count; k++) {
+                if (samplers != nullptr) thread_sampler() = samplers[k];
+                if (hit(rays[k], ray_t[k], recs[k])) hits |= 1ull << k;
+                if (samplers != nullptr) samplers[k] = thread_sampler();
+            }
+            return hits;
+        }
+
+        // Any-hit version of hit_packet(), bit k of the result is set when ray k is blocked
+        virtual uint64_t occluded_packet(const ray* rays, const interval* ray_t, int count, pixel_sampler* samplers) const {
+            uint64_t blocked = 0;
+            for (int k = 0; k < count; k++) {
+                if (samplers != nullptr) thread_sampler() = samplers[k];
+                if (occluded(rays[k], ray_t[k])) blocked |= 1ull << k;
+                if (samplers != nullptr) samplers[k] = thread_sampler();
+            }
+            return blocked;
+        }
+
         // Returns the bounding box for the object
         virtual aabb bounding_box() const = 0;
 
@@ -44,8 +111,47 @@ class hittable {
             return point3(0, 0, 0);  // Default value for generic hittable
         }
 
+        // Light sampling, implemented by the shapes that can be area lights (quad, sphere)
+        // translate and rotate_y pass it on to the object they move. Lights inside an instance
+        // or tlas are not sampled, as their transform may scale the light's solid angle: they
+        // are still seen when a path hits them, so keep lights meant for sampling out of them.
+
+        // Whether the object emits light and can be sampled with random() and light_pdf()
+        virtual bool is_light() const { return false; }
+
+        // Returns a direction from origin towards a random point of the object
+        virtual vec3 random(const point3& origin) const { return vec3(1, 0, 0); }
+
+        // Solid angle density with which random() picks the direction of a ray from origin that
+        // hit the object at rec
+        virtual double light_pdf(const ray& r, const hit_record& rec) const { return 0.0; }
+
+        // Adds every light inside the object to lights, the pointers stay valid as long as the
+        // object does
+        virtual void collect_lights(std::vector<const hittable*>& lights) const {
+            if (is_light()) lights.push_back(this);
+        }
+
+        // Adds the primitives whose tests are recorded by primitive_recorder(), in the order of
+        // their bits; objects that do not record add nothing
+        virtual void collect_primitives(std::vector<const hittable*>& primitives) const {}
+
+        // Whether where a ray hits the object, or if it does, is drawn at random, as in a
+        // participating medium, so the same ray may hit something else the next time
+        virtual bool hits_at_random() const { return false; }
+
+        // Adds everything the object's shape, placement and materials depend on to a scene hash
+        virtual void hash_state(state_hasher& h) const = 0;
+
+        // Changes every time the object is moved or turned, so a renderer can tell which objects
+        // are the same as in the previous frame
+        uint64_t revision() const { return revision_count; }
 
+        // Tells revision() the object's material was changed in place, which it cannot see
+        void material_changed() { revision_count++; }
 
+    protected:
+        uint64_t revision_count = 0;
 };
 
 // Type of htitable object that moves another object in space
@@ -61,22 +167,61 @@ class translate : public hittable {
     // Adjusts the ray's origin by the negative offset, checks if the offset ray hits the object
     // Adjusts the hit point by the positive offset
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!intersect(r, ray_t, rec))
+            return false;
+        surface_interaction(r, rec);
+        return true;
+    }
+
+    // A hit on the moved object itself is reported as a hit on the translate, which is what
+    // collect_lights() lists when the object is a light
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
         // Move the ray backwards by the offset
         ray offset_r(r.origin() - offset, r.direction(), r.time());
 
         // Determine where (if any) an intersection occurs along the offset ray
-        if (!object->hit(offset_r, ray_t, rec))
+        if (!object->intersect(offset_r, ray_t, rec))
             return false;
+        if (rec.object == object.get())
+            rec.object = this;
+        return true;
+    }
+
+    void surface_interaction(const ray& r, hit_record& rec) const override {
+        ray offset_r(r.origin() - offset, r.direction(), r.time());
+        object->surface_interaction(offset_r, rec);
 
         // Move the intersection point forwards by the offset
         rec.p += offset;
+    }
 
-        return true;
+    bool occluded(const ray& r, interval ray_t) const override {
+        ray offset_r(r.origin() - offset, r.direction(), r.time());
+        return object->occluded(offset_r, ray_t);
     }
 
     // Return the translated bounding box
     aabb bounding_box() const override { return bbox; }
 
+    bool hits_at_random() const override { return object->hits_at_random(); }
+
+    // Light sampling of the moved object, a translation keeps directions and solid angles
+    bool is_light() const override { return object->is_light(); }
+
+    vec3 random(const point3& origin) const override { return object->random(origin - offset); }
+
+    double light_pdf(const ray& r, const hit_record& rec) const override {
+        hit_record object_rec = rec;
+        object_rec.p = rec.p - offset;
+        return object->light_pdf(ray(r.origin() - offset, r.direction(), r.time()), object_rec);
+    }
+
+    void hash_state(state_hasher& h) const override {
+        h.add("translate");
+        h.add(offset);
+        object->hash_state(h);
+    }
+
   private:
     shared_ptr<hittable> object;    // Object being translated
     vec3 offset;                    // Vector indicating how much the object is moving
@@ -139,24 +284,24 @@ class rotate_y : public hittable {
 
     // Determines if a ray 'r' intersects with the rotated object within a specific interval ray_t
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!intersect(r, ray_t, rec))
+            return false;
+        surface_interaction(r, rec);
+        return true;
+    }
 
-        // Change the ray from world space to object space
-        auto origin = r.origin();
-        auto direction = r.direction();
-
-        // Apply a y-axis rotation transformation to the ray's origin
-        origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[2];
-        origin[2] = sin_theta*r.origin()[0] + cos_theta*r.origin()[2];
-
-        // Rotation transformation applied to the ray's direction
-        direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
-        direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
-
-        ray rotated_r(origin, direction, r.time());
-
-        // Determine where (if any) an intersection occurs in object space
-        if (!object->hit(rotated_r, ray_t, rec))
+    // Determines where (if any) an intersection occurs in object space
+    // A hit on the rotated object itself is reported as a hit on the rotate_y, see translate.
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!object->intersect(to_object(r), ray_t, rec))
             return false;
+        if (rec.object == object.get())
+            rec.object = this;
+        return true;
+    }
+
+    void surface_interaction(const ray& r, hit_record& rec) const override {
+        object->surface_interaction(to_object(r), rec);
 
         // Change the intersection point from object space to world space
         auto p = rec.p;
@@ -171,13 +316,38 @@ class rotate_y : public hittable {
         // Update the hit record
         rec.p = p;
         rec.normal = normal;
+    }
 
-        return true;
+    bool occluded(const ray& r, interval ray_t) const override {
+        return object->occluded(to_object(r), ray_t);
     }
 
     // Return the bounding box
     aabb bounding_box() const override { return bbox; }
 
+    bool hits_at_random() const override { return object->hits_at_random(); }
+
+    // Light sampling of the rotated object, a rotation keeps solid angles
+    bool is_light() const override { return object->is_light(); }
+
+    vec3 random(const point3& origin) const override {
+        return to_world(object->random(to_object(origin)));
+    }
+
+    double light_pdf(const ray& r, const hit_record& rec) const override {
+        hit_record object_rec = rec;
+        object_rec.p = to_object(rec.p);
+        object_rec.normal = to_object(rec.normal);
+        return object->light_pdf(to_object(r), object_rec);
+    }
+
+    void hash_state(state_hasher& h) const override {
+        h.add("rotate_y");
+        h.add(sin_theta);
+        h.add(cos_theta);
+        object->hash_state(h);
+    }
+
 
 
   private:
@@ -185,6 +355,32 @@ class rotate_y : public hittable {
     double sin_theta;
     double cos_theta;
     aabb bbox;
+
+    // A point or direction in object space, rotated back around the Y-axis
+    vec3 to_object(const vec3& v) const {
+        return vec3(cos_theta*v[0] - sin_theta*v[2], v[1], sin_theta*v[0] + cos_theta*v[2]);
+    }
+
+    // A point or direction of object space in world space
+    vec3 to_world(const vec3& v) const {
+        return vec3(cos_theta*v[0] + sin_theta*v[2], v[1], -sin_theta*v[0] + cos_theta*v[2]);
+    }
+
+    // The ray in object space, rotated back around the Y-axis
+    ray to_object(const ray& r) const {
+        auto origin = r.origin();
+        auto direction = r.direction();
+
+        // Apply a y-axis rotation transformation to the ray's origin
+        origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[2];
+        origin[2] = sin_theta*r.origin()[0] + cos_theta*r.origin()[2];
+
+        // Rotation transformation applied to the ray's direction
+        direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
+        direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
+
+        return ray(origin, direction, r.time());
+    }
 };
 
 #endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "hittable.h"
 #include "main.h"
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include "aabb.h"
@@ -43,30 +44,61 @@ class hittable_list : public hittable {
         }
 
         // Checks for intersection between a ray and all objects in the list
+        // Only the surface of the closest object's hit is evaluated, once every object was tested
         bool hit(
             const ray& r, interval ray_t, hit_record& rec) const override {
                 // Local variables to store 
-                hit_record temp_rec;                // the temporary hit record
-                auto hit_anything = false;          // whether a hit occurred
+                const hittable* closest = nullptr;  // the object hit closest so far
                 auto closest_so_far = ray_t.max;    // closest hit distance
 
                 // Checks each object in the list for a hit
                 for (const auto& object : objects) {
-                    if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
-                        hit_anything = true;
-                        closest_so_far = temp_rec.t;    // update closest hit distance
-                        rec = temp_rec;                 // and hit record
+                    if (object->intersect(r, interval(ray_t.min, closest_so_far), rec)) {
+                        closest = object.get();
+                        closest_so_far = rec.t;         // update closest hit distance
                     }
                 }
 
-                return hit_anything;
+                if (closest == nullptr)
+                    return false;
+
+                closest->surface_interaction(r, rec);
+                return true;
 
             }
 
+        // Checks the objects in order until one of them is in the way
+        bool occluded(const ray& r, interval ray_t) const override {
+            for (const auto& object : objects) {
+                if (object->occluded(r, ray_t))
+                    return true;
+            }
+            return false;
+        }
+
 
         // Returns the bounding box of the entire list
         aabb bounding_box() const override { return bbox; }
 
+        void hash_state(state_hasher& h) const override {
+            h.add("hittable_list");
+            h.add(static_cast<uint64_t>(objects.size()));
+            for (const auto& object : objects)
+                object->hash_state(h);
+        }
+
+        // Collects the lights of every object in the list
+        void collect_lights(std::vector<const hittable*>& lights) const override {
+            for (const auto& object : objects)
+                object->collect_lights(lights);
+        }
+
+        bool hits_at_random() const override {
+            for (const auto& object : objects)
+                if (object->hits_at_random()) return true;
+            return false;
+        }
+
     
     private:
         // Combined bounding box of all list objects
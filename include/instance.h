@@ -0,0 +1,150 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "main.h"
+#include "hittable.h"
+#include "bvh.h"
+#include "transform.h"
+
+#include <vector>
+
+// Places a shared object in the scene with an affine transform
+// The object (usually a PolygonMesh with its own bottom-level hierarchy) is only referenced, so
+// any number of instances share one copy of its geometry. Rays are moved into object space with
+// the cached inverse instead of moving the geometry into world space. Lights inside an instance
+// are shaded when a path hits them but are not sampled directly, see hittable::is_light().
+class instance : public hittable {
+  public:
+    instance(shared_ptr<hittable> object, const transform& object_to_world)
+      : object(object), object_to_world(object_to_world), world_to_object(object_to_world.inverse())
+    {
+        bbox = object_to_world.box(object->bounding_box());
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!intersect(r, ray_t, rec))
+            return false;
+        surface_interaction(r, rec);
+        return true;
+    }
+
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        return object->intersect(to_object(r), ray_t, rec);
+    }
+
+    void surface_interaction(const ray& r, hit_record& rec) const override {
+        object->surface_interaction(to_object(r), rec);
+
+        // Move the hit back to world space, normals use the inverse transpose
+        rec.p = object_to_world.point(rec.p);
+        rec.normal = unit_vector(world_to_object.transposed_vector(rec.normal));
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        return object->occluded(to_object(r), ray_t);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    point3 get_center() const override { return bbox.centroid(); }
+
+    bool hits_at_random() const override { return object->hits_at_random(); }
+
+    void hash_state(state_hasher& h) const override {
+        h.add("instance");
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                h.add(object_to_world.m[i][j]);
+        object->hash_state(h);
+    }
+
+  private:
+    shared_ptr<hittable> object;    // Shared bottom-level geometry
+    transform object_to_world;      // Placement of the object
+    transform world_to_object;      // Cached inverse of object_to_world
+    aabb bbox;                      // World space box around the placed object
+
+    // The ray in object space
+    // The direction is not normalized, so t means the same thing in both spaces
+    ray to_object(const ray& r) const {
+        return ray(world_to_object.point(r.origin()), world_to_object.vector(r.direction()), r.time());
+    }
+};
+
+// Top-level acceleration structure over a set of instances
+// Holds the instances by value in leaf order next to a flattened hierarchy over their world
+// space boxes, so a scene with thousands of instances of a few meshes is one more level of
+// hierarchy on top of each mesh's own.
+class tlas : public hittable {
+  public:
+    tlas() {}
+
+    // Adds an instance of object placed with object_to_world, call build() once all are added
+    void add(shared_ptr<hittable> object, const transform& object_to_world) {
+        instances.push_back(instance(object, object_to_world));
+    }
+
+    // Builds the hierarchy over the instances added so far
+    void build() {
+        std::vector<aabb> bounds;
+        bounds.reserve(instances.size());
+        for (const auto& inst : instances)
+            bounds.push_back(inst.bounding_box());
+
+        tree.build(bounds, kMaxLeafSize);
+
+        std::vector<instance> ordered;
+        ordered.reserve(instances.size());
+        for (uint32_t i : tree.primitive_order())
+            ordered.push_back(instances[i]);
+        instances.swap(ordered);
+    }
+
+    // Only the surface of the closest instance's hit is evaluated
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        const instance* closest = nullptr;
+        tree.intersect(r, ray_t, [&](uint32_t i, const interval& t_range, double& t) {
+            if (!instances[i].intersect(r, t_range, rec))
+                return false;
+            closest = &instances[i];
+            t = rec.t;
+            return true;
+        });
+
+        if (closest == nullptr)
+            return false;
+        closest->surface_interaction(r, rec);
+        return true;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        return tree.occluded(r, ray_t, [&](uint32_t i, const interval& t_range) {
+            return instances[i].occluded(r, t_range);
+        });
+    }
+
+    aabb bounding_box() const override { return tree.bounds(); }
+
+    bool hits_at_random() const override {
+        for (const auto& inst : instances)
+            if (inst.hits_at_random()) return true;
+        return false;
+    }
+
+    void hash_state(state_hasher& h) const override {
+        h.add("tlas");
+        for (const auto& inst : instances)
+            inst.hash_state(h);
+    }
+
+    size_t size() const { return instances.size(); }
+
+  private:
+    // Leaves hold at most this many instances
+    static const int kMaxLeafSize = 2;
+
+    std::vector<instance> instances;    // Instances, in leaf order after build()
+    linear_bvh tree;                    // Hierarchy over the instance boxes
+};
+
+#endif
@@ -5,7 +5,9 @@
 #include <limits>
 #include <memory>
 #include <cstdlib>
-#include <random>
+#include <cstdint>
+
+#include "sampler.h"
 
 // Usings
 using std::shared_ptr;
@@ -26,6 +28,14 @@ extern std::atomic<uint64_t> numRayTrianglesIsect;
 extern std::atomic<uint64_t> boundingVolumeIsect;
 extern std::atomic<uint64_t> objectIsect;
 extern std::atomic<uint64_t> totalNumTris;
+extern std::atomic<uint64_t> numBVHTraversals;
+extern std::atomic<uint64_t> numBVHNodeVisits;
+extern std::atomic<uint64_t> numBVHBuilds;
+extern std::atomic<uint64_t> bvhBuildMicroseconds;
+extern double bvhSAHCostTotal;
+extern std::atomic<uint64_t> numBVHRefits;
+extern std::atomic<uint64_t> bvhRefitMicroseconds;
+extern std::atomic<uint64_t> numPathSegments;
 
 
 // Utility functions
@@ -34,10 +44,32 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// Sampler random_double() draws from, one per thread
+inline pixel_sampler& thread_sampler() {
+    static thread_local pixel_sampler sampler;
+    return sampler;
+}
+
+// Starts the random sequence of one sample of the pixel in column x of row y, which is expected
+// to take sample_count samples
+// Every random number used by the sample then depends only on (frame, pixel, sample, draw
+// index), so an image does not depend on which thread rendered which pixel. The first
+// static_dimensions dimensions are the same on every frame.
+inline void start_sample(sampler_type type, uint32_t frame, uint32_t x, uint32_t y, uint32_t sample, uint32_t sample_count,
+                         uint32_t static_dimensions = 0) {
+    uint64_t pixel = (static_cast<uint64_t>(y) << 16) | x;
+    uint64_t key = mix_bits((static_cast<uint64_t>(frame) << 32) | pixel);
+    thread_sampler().start(type, key, mix_bits(pixel), frame, x, y, sample, sample_count, static_dimensions);
+}
+
+// Continues the current sample at dimension d, see pixel_sampler::seek
+inline void seek_sample_dimension(uint32_t d) {
+    thread_sampler().seek(d);
+}
+
 inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    // Returns a random real in [0, 1).
+    return thread_sampler().next_double();
 }
 
 inline double random_double(double min, double max) {
@@ -20,6 +20,33 @@ class material {
             const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
         ) const = 0;
 
+        // Whether emitted() returns light, surfaces with such a material are area lights
+        virtual bool is_emissive() const { return false; }
+
+        // Whether scatter() picks directions from a delta distribution (perfect mirror, glass)
+        // that eval() and pdf() cannot describe. Specular surfaces do not sample lights.
+        virtual bool is_specular() const { return true; }
+
+        // Light scattered towards r_in per unit light arriving from direction, cosine included
+        virtual color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+            return color(0,0,0);
+        }
+
+        // Solid angle density with which scatter() picks direction
+        // For every direction scatter() can return, attenuation equals eval() / pdf().
+        virtual double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+            return 0.0;
+        }
+
+        // Color the surface tints reflected light with, read by the denoiser
+        // White for glass and lights, which do not tint what is seen through or on them.
+        virtual color surface_albedo(const hit_record& rec) const {
+            return color(1,1,1);
+        }
+
+        // Adds everything the material's behaviour depends on to a scene hash
+        virtual void hash_state(state_hasher& h) const = 0;
+
 };
 
 // Diffuse material
@@ -44,6 +71,28 @@ class lambertian : public material {
             return true;
         }
 
+        bool is_specular() const override { return false; }
+
+        // albedo / pi times the cosine to the normal
+        color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            return albedo->value(rec.u, rec.v, rec.p) * pdf(r_in, rec, direction);
+        }
+
+        // normal + random_unit_vector() is cosine distributed, cosine / pi
+        double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            double cosine = dot(rec.normal, unit_vector(direction));
+            return cosine > 0 ? cosine / pi : 0.0;
+        }
+
+        color surface_albedo(const hit_record& rec) const override {
+            return albedo->value(rec.u, rec.v, rec.p);
+        }
+
+        void hash_state(state_hasher& h) const override {
+            h.add("lambertian");
+            albedo->hash_state(h);
+        }
+
     private:
         //color albedo;
         shared_ptr<texture> albedo;
@@ -69,6 +118,47 @@ class metal : public material {
             return (dot(scattered.direction(), rec.normal) > 0);
         }
 
+        // Only a perfect mirror is specular, fuzzy metal has a density around the reflection
+        bool is_specular() const override { return fuzz <= 0; }
+
+        color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            return albedo->value(rec.u, rec.v, rec.p) * pdf(r_in, rec, direction);
+        }
+
+        // Density of the direction of reflected + fuzz * (point in the unit ball)
+        // The offset point is uniform in a ball of radius fuzz around the unit reflection, so the
+        // density of a direction is the ball's volume along that direction, weighted by t^2:
+        // the integral of t^2 over the chord [t1, t2] divided by the ball's volume. Directions
+        // below the surface are absorbed, so they have no density.
+        double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            if (fuzz <= 0) return 0.0;
+
+            vec3 w = unit_vector(direction);
+            if (dot(w, rec.normal) <= 0) return 0.0;
+
+            vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+            double c = dot(w, reflected);
+            double discriminant = c*c - 1 + fuzz*fuzz;
+            if (discriminant <= 0) return 0.0;
+
+            double root = sqrt(discriminant);
+            double t1 = fmax(c - root, 0.0);
+            double t2 = c + root;
+            if (t2 <= 0) return 0.0;
+
+            return (t2*t2*t2 - t1*t1*t1) / (4*pi*fuzz*fuzz*fuzz);
+        }
+
+        color surface_albedo(const hit_record& rec) const override {
+            return albedo->value(rec.u, rec.v, rec.p);
+        }
+
+        void hash_state(state_hasher& h) const override {
+            h.add("metal");
+            albedo->hash_state(h);
+            h.add(fuzz);
+        }
+
     public:
         //color albedo;
         shared_ptr<texture> albedo;
@@ -106,6 +196,11 @@ class dielectric : public material {
             return true;
         }
 
+        void hash_state(state_hasher& h) const override {
+            h.add("dielectric");
+            h.add(ir);
+        }
+
     public:
         double ir; // Index of Refraction
 
@@ -135,6 +230,16 @@ class diffuse_light : public material {
         return emit->value(u, v, p);
     }
 
+    bool is_emissive() const override { return true; }
+
+    // Makes the light emit c, call material_changed() on the objects that use it
+    void set_color(const color& c) { emit = make_shared<solid_color>(c); }
+
+    void hash_state(state_hasher& h) const override {
+        h.add("diffuse_light");
+        emit->hash_state(h);
+    }
+
   private:
     shared_ptr<texture> emit;
 };
@@ -154,6 +259,26 @@ class isotropic : public material {
         return true;
     }
 
+    bool is_specular() const override { return false; }
+
+    // Uniform phase function, albedo / (4 pi) in every direction
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return albedo->value(rec.u, rec.v, rec.p) / (4 * pi);
+    }
+
+    double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return 1 / (4 * pi);
+    }
+
+    color surface_albedo(const hit_record& rec) const override {
+        return albedo->value(rec.u, rec.v, rec.p);
+    }
+
+    void hash_state(state_hasher& h) const override {
+        h.add("isotropic");
+        albedo->hash_state(h);
+    }
+
   private:
     shared_ptr<texture> albedo;
 };
@@ -0,0 +1,77 @@
+#ifndef MATERIAL_TABLE_H
+#define MATERIAL_TABLE_H
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class material;
+
+// Materials of the scene, referred to by 32-bit handles
+// Primitives register their material once when they are made and keep the handle, so a hit
+// copies a number instead of a shared_ptr, whose reference count is an atomic every thread
+// shares. The table keeps its materials alive until clear(), and registering a material again
+// returns the handle it already has. add() is not synchronised: materials are registered by one
+// thread, between frames, while no thread reads the table. Debug builds assert both.
+class material_table {
+  public:
+    // Marks the time render threads read the table, add() must not run then
+    class read_scope {
+      public:
+        explicit read_scope(material_table& table) : table(table) { table.readers++; }
+        ~read_scope() { table.readers--; }
+
+      private:
+        material_table& table;
+    };
+
+    uint32_t add(const std::shared_ptr<material>& m) {
+        assert(readers == 0 && "materials are registered between frames");
+        assert((owner == std::thread::id() || owner == std::this_thread::get_id()) &&
+               "materials are registered by one thread");
+        owner = std::this_thread::get_id();
+
+        auto found = handle_of.find(m.get());
+        if (found != handle_of.end())
+            return found->second;
+
+        uint32_t handle = static_cast<uint32_t>(entries.size());
+        owned.push_back(m);
+        entries.push_back(m.get());
+        handle_of[m.get()] = handle;
+        return handle;
+    }
+
+    const material* operator[](uint32_t handle) const { return entries[handle]; }
+
+    size_t size() const { return entries.size(); }
+
+    // Frees every material, before a program builds an unrelated scene; the primitives made
+    // before must not be rendered or hashed again, as their handles now mean nothing
+    // Another thread may register materials from then on.
+    void clear() {
+        assert(readers == 0 && "materials are cleared between frames");
+        owned.clear();
+        entries.clear();
+        handle_of.clear();
+        owner = std::thread::id();
+    }
+
+  private:
+    std::vector<std::shared_ptr<material>> owned;           // Keeps the materials alive
+    std::vector<const material*> entries;                   // Material of each handle
+    std::unordered_map<const material*, uint32_t> handle_of;
+    int readers = 0;                                        // Open read_scopes
+    std::thread::id owner;                                  // Thread that registers materials
+};
+
+// Table every primitive registers its material in
+inline material_table& scene_materials() {
+    static material_table table;
+    return table;
+}
+
+#endif
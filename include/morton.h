@@ -0,0 +1,98 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include "main.h"
+#include "parallel.h"
+
+#include <cstdint>
+#include <vector>
+
+// Spreads the low 10 bits of x so there are two zero bits between each of them
+inline uint64_t left_shift_3_10(uint64_t x) {
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x30000ff;
+    x = (x | (x <<  8)) & 0x300f00f;
+    x = (x | (x <<  4)) & 0x30c30c3;
+    x = (x | (x <<  2)) & 0x9249249;
+    return x;
+}
+
+// Spreads the low 21 bits of x so there are two zero bits between each of them
+inline uint64_t left_shift_3_21(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x1f00000000ffffull;
+    x = (x | (x << 16)) & 0x1f0000ff0000ffull;
+    x = (x | (x <<  8)) & 0x100f00f00f00f00full;
+    x = (x | (x <<  4)) & 0x10c30c30c30c30c3ull;
+    x = (x | (x <<  2)) & 0x1249249249249249ull;
+    return x;
+}
+
+// Interleaves the bits of three coordinates in [0, 1] into a Morton code of 3*bits_per_axis bits
+// Bit b of the code belongs to the x axis when b % 3 == 0, y when b % 3 == 1 and z when b % 3 == 2.
+// bits_per_axis is 10 (30-bit codes) or 21 (63-bit codes).
+inline uint64_t encode_morton3(double x, double y, double z, int bits_per_axis) {
+    const double scale = static_cast<double>((1u << bits_per_axis) - 1);
+    auto quantize = [scale](double v) {
+        return static_cast<uint64_t>(clamp(v, 0.0, 1.0) * scale);
+    };
+
+    if (bits_per_axis == 10)
+        return (left_shift_3_10(quantize(z)) << 2) | (left_shift_3_10(quantize(y)) << 1) | left_shift_3_10(quantize(x));
+
+    return (left_shift_3_21(quantize(z)) << 2) | (left_shift_3_21(quantize(y)) << 1) | left_shift_3_21(quantize(x));
+}
+
+// Primitive index paired with the Morton code of its centroid
+struct morton_primitive {
+    uint64_t code;
+    uint32_t index;
+};
+
+// Sorts primitives by the low key_bits bits of their Morton code
+// Least significant digit radix sort with 8-bit digits. Each pass counts the digits of a
+// chunk per thread, turns the counts into per-chunk output offsets and scatters in parallel, so
+// the sort stays stable and the result does not depend on the number of threads.
+inline void parallel_radix_sort(std::vector<morton_primitive>& items, int key_bits) {
+    const int kDigitBits = 8;
+    const int kBuckets = 1 << kDigitBits;
+
+    if (items.size() < 2) return;
+
+    std::vector<morton_primitive> temp(items.size());
+    int chunks = std::max(1, std::min(parallel_thread_count(), static_cast<int>(items.size() / 4096) + 1));
+    std::vector<size_t> offsets(static_cast<size_t>(chunks) * kBuckets);
+
+    for (int shift = 0; shift < key_bits; shift += kDigitBits) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+
+        // Count how many items of each chunk fall into each bucket
+        parallel_chunks(items.size(), chunks, [&](int c, size_t begin, size_t end) {
+            size_t* count = &offsets[static_cast<size_t>(c) * kBuckets];
+            for (size_t i = begin; i < end; i++)
+                count[(items[i].code >> shift) & (kBuckets - 1)]++;
+        });
+
+        // Exclusive prefix sum in bucket-major order gives every chunk its write position per bucket
+        size_t total = 0;
+        for (int b = 0; b < kBuckets; b++) {
+            for (int c = 0; c < chunks; c++) {
+                size_t& slot = offsets[static_cast<size_t>(c) * kBuckets + b];
+                size_t n = slot;
+                slot = total;
+                total += n;
+            }
+        }
+
+        // Scatter each chunk into its slots
+        parallel_chunks(items.size(), chunks, [&](int c, size_t begin, size_t end) {
+            size_t* next = &offsets[static_cast<size_t>(c) * kBuckets];
+            for (size_t i = begin; i < end; i++)
+                temp[next[(items[i].code >> shift) & (kBuckets - 1)]++] = items[i];
+        });
+
+        items.swap(temp);
+    }
+}
+
+#endif
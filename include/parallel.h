@@ -0,0 +1,225 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of threads the parallel helpers may use, 0 means one per hardware thread
+// One setting for the whole program, shared by every translation unit.
+inline int& parallel_thread_setting() {
+    static int setting = 0;
+    return setting;
+}
+
+// Returns the number of threads the parallel helpers will use
+inline int parallel_thread_count() {
+    if (parallel_thread_setting() > 0) return parallel_thread_setting();
+
+    int hardware = static_cast<int>(std::thread::hardware_concurrency());
+    return hardware > 0 ? hardware : 1;
+}
+
+// Persistent pool of worker threads with one task queue per thread
+// The threads are started once and sleep between jobs, so every frame, build or sort reuses
+// them instead of paying for thread creation. The calling thread takes part in every job as
+// thread 0.
+class thread_pool {
+  public:
+    // num_threads counts the calling thread, so num_threads - 1 workers are started
+    explicit thread_pool(int num_threads) {
+        num_threads = std::max(num_threads, 1);
+        for (int i = 0; i < num_threads; i++)
+            queues.emplace_back(new task_queue());
+        for (int i = 1; i < num_threads; i++)
+            workers.emplace_back([this, i]() { worker_loop(i); });
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    int size() const { return static_cast<int>(queues.size()); }
+
+    // Calls fn(task, thread) for every task in [0, num_tasks) and returns once all are done
+    // Each thread is dealt a contiguous run of tasks, so neighbouring tasks tend to run on the
+    // same thread. A thread whose queue runs dry steals from the back of another thread's
+    // queue. Calls made from inside a task run inline on the calling thread.
+    template <typename Fn>
+    void run(int num_tasks, Fn fn) {
+        if (num_tasks <= 0) return;
+
+        if (size() == 1 || current_thread() >= 0) {
+            int thread = std::max(current_thread(), 0);
+            for (int t = 0; t < num_tasks; t++)
+                fn(t, thread);
+            return;
+        }
+
+        std::function<void(int, int)> task_fn = fn;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int q = 0; q < size(); q++) {
+                std::lock_guard<std::mutex> queue_lock(queues[q]->mutex);
+                int begin = static_cast<int>(static_cast<long long>(num_tasks) * q / size());
+                int end = static_cast<int>(static_cast<long long>(num_tasks) * (q + 1) / size());
+                for (int t = begin; t < end; t++)
+                    queues[q]->tasks.push_back(t);
+            }
+            remaining.store(num_tasks);
+            job = &task_fn;
+            generation++;
+        }
+        wake.notify_all();
+
+        work(0, task_fn);
+
+        // Wait for the other threads to finish their tasks and to stop looking at the queues
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]() { return remaining.load() == 0 && active == 0; });
+        job = nullptr;
+    }
+
+  private:
+    struct task_queue {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    std::vector<std::unique_ptr<task_queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;                               // Guards job, generation, active and stopping
+    std::condition_variable wake;                   // Signals workers that a job was posted
+    std::condition_variable done;                   // Signals run() that a worker finished
+    const std::function<void(int, int)>* job = nullptr;
+    uint64_t generation = 0;                        // Incremented for every posted job
+    int active = 0;                                 // Workers currently working on the job
+    bool stopping = false;
+    std::atomic<int> remaining{0};                  // Tasks of the current job not finished yet
+
+    // Index of the pool thread running a task on this thread, -1 outside of tasks
+    static int& current_thread() {
+        static thread_local int thread = -1;
+        return thread;
+    }
+
+    void worker_loop(int index) {
+        uint64_t seen = 0;
+        while (true) {
+            const std::function<void(int, int)>* fn;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]() { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                fn = job;
+                if (fn == nullptr) continue;
+                active++;
+            }
+
+            work(index, *fn);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                active--;
+            }
+            done.notify_all();
+        }
+    }
+
+    // Runs tasks until every queue is empty
+    void work(int index, const std::function<void(int, int)>& fn) {
+        current_thread() = index;
+
+        int task;
+        while (take(index, task)) {
+            fn(task, index);
+            if (remaining.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.notify_all();
+            }
+        }
+
+        current_thread() = -1;
+    }
+
+    // Pops the next task of a thread's own queue, or steals the last task of another queue
+    bool take(int index, int& task) {
+        {
+            task_queue& own = *queues[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = own.tasks.front();
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+
+        for (int k = 1; k < size(); k++) {
+            task_queue& victim = *queues[(index + k) % size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
+
+// Pool shared by all parallel helpers, restarted when parallel_thread_setting() changes
+inline thread_pool& global_thread_pool() {
+    static std::unique_ptr<thread_pool> pool;
+    if (!pool || pool->size() != parallel_thread_count())
+        pool.reset(new thread_pool(parallel_thread_count()));
+    return *pool;
+}
+
+// Splits [0, count) into num_chunks contiguous ranges and calls fn(chunk, begin, end) for each
+// one on the thread pool. The calling thread helps and returns once all chunks are done.
+template <typename Fn>
+void parallel_chunks(size_t count, int num_chunks, Fn fn) {
+    num_chunks = std::max(1, std::min(num_chunks, static_cast<int>(std::max<size_t>(count, 1))));
+
+    auto chunk_begin = [&](int c) { return count * c / num_chunks; };
+
+    if (num_chunks == 1) {
+        fn(0, chunk_begin(0), chunk_begin(1));
+        return;
+    }
+
+    global_thread_pool().run(num_chunks, [&](int c, int) { fn(c, chunk_begin(c), chunk_begin(c + 1)); });
+}
+
+// Calls fn(i) for every i in [0, count), spread across the available threads
+// Ranges smaller than min_per_thread items per thread use fewer threads.
+template <typename Fn>
+void parallel_for(size_t count, Fn fn, size_t min_per_thread = 1024) {
+    int threads = static_cast<int>(std::min<size_t>(parallel_thread_count(), count / std::max<size_t>(min_per_thread, 1) + 1));
+
+    parallel_chunks(count, threads, [&](int, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            fn(i);
+    });
+}
+
+#endif
@@ -2,20 +2,28 @@
 #define PERLIN_H
 
 #include "main.h"
+#include "state_hash.h"
 
 class perlin {
   public:
-    perlin() {
+    // The gradients and permutations come from their own stream, so the noise only depends on
+    // seed and not on what was drawn before the texture was made
+    perlin(uint64_t seed = 0) {
+        random_stream rng(mix_bits(seed));
+
 		ranvec = new vec3[point_count];
 
         //ranfloat = new double[point_count];
         for (int i = 0; i < point_count; ++i) {
-            ranvec[i] = unit_vector(vec3::random(-1,1)); //random_double();
+            double x = rng.next_double(-1, 1);
+            double y = rng.next_double(-1, 1);
+            double z = rng.next_double(-1, 1);
+            ranvec[i] = unit_vector(vec3(x, y, z)); //random_double();
         }
 
-        perm_x = perlin_generate_perm();
-        perm_y = perlin_generate_perm();
-        perm_z = perlin_generate_perm();
+        perm_x = perlin_generate_perm(rng);
+        perm_y = perlin_generate_perm(rng);
+        perm_z = perlin_generate_perm(rng);
     }
 
     ~perlin() {
@@ -25,6 +33,16 @@ class perlin {
         delete[] perm_z;
     }
 
+    // Adds the gradients and permutations to a scene hash
+    void hash_state(state_hasher& h) const {
+        for (int i = 0; i < point_count; ++i) {
+            h.add(ranvec[i]);
+            h.add(perm_x[i]);
+            h.add(perm_y[i]);
+            h.add(perm_z[i]);
+        }
+    }
+
 	double turb(const point3& p, int depth=7) const {
         auto accum = 0.0;
         auto temp_p = p;
@@ -71,20 +89,20 @@ class perlin {
     int* perm_y;
     int* perm_z;
 
-    static int* perlin_generate_perm() {
+    static int* perlin_generate_perm(random_stream& rng) {
         auto p = new int[point_count];
 
         for (int i = 0; i < perlin::point_count; i++)
             p[i] = i;
 
-        permute(p, point_count);
+        permute(p, point_count, rng);
 
         return p;
     }
 
-    static void permute(int* p, int n) {
+    static void permute(int* p, int n, random_stream& rng) {
         for (int i = n-1; i > 0; i--) {
-            int target = random_int(0, i);
+            int target = static_cast<int>(rng.next_double(0, i+1));
             int tmp = p[i];
             p[i] = p[target];
             p[target] = tmp;
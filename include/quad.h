@@ -5,17 +5,19 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "material.h"
 #include <cmath>
 
 class quad : public hittable {
   public:
     quad(const point3& _Q, const vec3& _u, const vec3& _v, shared_ptr<material> m)
-      : Q(_Q), u(_u), v(_v), mat(m)
+      : Q(_Q), u(_u), v(_v), material_id(scene_materials().add(m))
     {
 		auto n = cross(u, v);
 		normal = unit_vector(n);
 		D = dot(normal, Q);
 		w = n / dot(n,n);
+		area = n.length();
 
         set_bounding_box();
     }
@@ -26,7 +28,23 @@ class quad : public hittable {
 
     aabb bounding_box() const override { return bbox; }
 
+    void hash_state(state_hasher& h) const override {
+        h.add("quad");
+        h.add(Q);
+        h.add(u);
+        h.add(v);
+        scene_materials()[material_id]->hash_state(h);
+    }
+
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!intersect(r, ray_t, rec))
+            return false;
+        surface_interaction(r, rec);
+        return true;
+    }
+
+    // Finds the plane crossing and its plane coordinates, which are the UVs
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
         auto denom = dot(normal, r.direction());
 
         // No hit if the ray is parallel to the plane.
@@ -47,16 +65,37 @@ class quad : public hittable {
         if (!is_interior(alpha, beta, rec))
             return false;
 
-        // Ray hits the 2D shape; set the rest of the hit record and return true.
-
+        // Ray hits the 2D shape; set t and return true.
         rec.t = t;
-        rec.p = intersection;
-        rec.mat_ptr = mat;
-        rec.set_face_normal(r, normal);
+        rec.object = this;
 
         return true;
     }
 
+    void surface_interaction(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        rec.material_id = material_id;
+        rec.set_face_normal(r, normal);
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        auto denom = dot(normal, r.direction());
+        if (fabs(denom) < 1e-8)
+            return false;
+
+        auto t = (D - dot(normal, r.origin())) / denom;
+        if (!ray_t.contains(t))
+            return false;
+
+        vec3 planar_hitpt_vector = r.at(t) - Q;
+        auto alpha = dot(w, cross(planar_hitpt_vector, v));
+        auto beta = dot(w, cross(u, planar_hitpt_vector));
+
+        // is_interior() also writes the UV coordinates, which nothing reads here
+        hit_record uv;
+        return is_interior(alpha, beta, uv);
+    }
+
 	virtual bool is_interior(double a, double b, hit_record& rec) const {
         // Given the hit point in plane coordinates, return false if it is outside the
         // primitive, otherwise set the hit record UV coordinates and return true.
@@ -69,20 +108,38 @@ class quad : public hittable {
         return true;
     }
 
+	bool is_light() const override { return scene_materials()[material_id]->is_emissive(); }
+
+	// Uniformly distributed point of the quad
+	vec3 random(const point3& origin) const override {
+		point3 p = Q + (random_double() * u) + (random_double() * v);
+		return p - origin;
+	}
+
+	// Uniform area density converted to solid angle: distance^2 / (cosine * area)
+	double light_pdf(const ray& r, const hit_record& rec) const override {
+		double distance_squared = rec.t * rec.t * r.direction().length_squared();
+		double cosine = fabs(dot(r.direction(), normal) / r.direction().length());
+		if (cosine < 1e-8) return 0.0;
+		return distance_squared / (cosine * area);
+	}
+
 	void translate(const vec3& translation_vector) {
 		Q += translation_vector;
 		set_bounding_box();
 		D = dot(normal, Q);
+		revision_count++;
 	}
 
   private:
     point3 Q;
     vec3 u, v;
-    shared_ptr<material> mat;
+    uint32_t material_id;
     aabb bbox;
 	vec3 normal;
 	double D;
 	vec3 w;
+	double area;
 };
 
 inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<material> mat)
@@ -0,0 +1,130 @@
+#ifndef RAY_FOOTPRINT_H
+#define RAY_FOOTPRINT_H
+
+#include <algorithm>
+#include <cstdint>
+
+#include "main.h"
+#include "aabb.h"
+
+// Coarse grid over the scene, whose cells a set of ray segments crossed are kept as a bitset
+// The incremental renderer keeps one bitset a tile: a box that changed can only change the
+// tile's paths if one of their segments, camera, bounce or shadow ray, crossed a cell it covers.
+class footprint_grid {
+  public:
+    static const int kCells = 16;                               // Cells along each axis
+    static const int kWords = kCells * kCells * kCells / 64;    // Words of a bitset over the cells
+
+    // Fits the grid around the scene's bounds, with a margin so objects on them are inside
+    void reset(const aabb& bounds) {
+        for (int a = 0; a < 3; a++) {
+            const interval& extent = bounds.axis(a);
+            double margin = 1e-3 * std::max(extent.size(), 1.0);
+            low[a] = extent.min - margin;
+            cell[a] = (extent.size() + 2 * margin) / kCells;
+        }
+    }
+
+    // Whether the box lies inside the grid, rays that left the grid are not followed
+    bool contains(const aabb& box) const {
+        for (int a = 0; a < 3; a++)
+            if (box.axis(a).min < low[a] || box.axis(a).max > low[a] + kCells * cell[a])
+                return false;
+        return true;
+    }
+
+    // Marks the cells the box covers, grown by a sliver of a cell so a segment that crosses
+    // the box right on a cell boundary is not lost to rounding
+    void mark_box(const aabb& box, uint64_t* bits) const {
+        int from[3], to[3];
+        for (int a = 0; a < 3; a++) {
+            double sliver = 0.01 * cell[a];
+            from[a] = clamp_cell((box.axis(a).min - sliver - low[a]) / cell[a]);
+            to[a] = clamp_cell((box.axis(a).max + sliver - low[a]) / cell[a]);
+        }
+        for (int z = from[2]; z <= to[2]; z++)
+            for (int y = from[1]; y <= to[1]; y++)
+                for (int x = from[0]; x <= to[0]; x++)
+                    set(bits, x, y, z);
+    }
+
+    // Marks the cells the segment of r between t0 and t1 crosses, walked cell by cell (3D DDA)
+    void mark_segment(const ray& r, double t0, double t1, uint64_t* bits) const {
+        const point3& origin = r.origin();
+        const vec3& direction = r.direction();
+
+        // Clip the segment to the grid
+        for (int a = 0; a < 3; a++) {
+            double high = low[a] + kCells * cell[a];
+            if (direction[a] == 0) {
+                if (origin[a] < low[a] || origin[a] > high) return;
+                continue;
+            }
+            double near = (low[a] - origin[a]) / direction[a];
+            double far = (high - origin[a]) / direction[a];
+            if (near > far) std::swap(near, far);
+            t0 = std::max(t0, near);
+            t1 = std::min(t1, far);
+        }
+        if (!(t0 <= t1)) return;
+
+        int index[3], step[3];
+        double next[3], delta[3];
+        for (int a = 0; a < 3; a++) {
+            index[a] = clamp_cell((origin[a] + t0 * direction[a] - low[a]) / cell[a]);
+            if (direction[a] == 0) {
+                step[a] = 0;
+                next[a] = infinity;
+                delta[a] = infinity;
+                continue;
+            }
+            step[a] = direction[a] > 0 ? 1 : -1;
+            double boundary = low[a] + (index[a] + (step[a] > 0 ? 1 : 0)) * cell[a];
+            next[a] = (boundary - origin[a]) / direction[a];
+            delta[a] = cell[a] / std::fabs(direction[a]);
+        }
+
+        while (true) {
+            set(bits, index[0], index[1], index[2]);
+            int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+            if (next[a] > t1) return;
+            index[a] += step[a];
+            if (index[a] < 0 || index[a] >= kCells) return;
+            next[a] += delta[a];
+        }
+    }
+
+  private:
+    double low[3] = {0, 0, 0};      // Lowest corner of the grid
+    double cell[3] = {1, 1, 1};     // Size of a cell along each axis
+
+    static int clamp_cell(double c) {
+        return static_cast<int>(clamp(std::floor(c), 0, kCells - 1));
+    }
+
+    static void set(uint64_t* bits, int x, int y, int z) {
+        uint32_t i = (static_cast<uint32_t>(z) * kCells + y) * kCells + x;
+        bits[i >> 6] |= 1ull << (i & 63);
+    }
+};
+
+// Grid and bitset the current thread's ray segments are marked in, while primitive_recorder()
+// records the primitives they are tested against; cells is nullptr when nothing records them
+struct footprint_recording {
+    const footprint_grid* grid = nullptr;
+    uint64_t* cells = nullptr;
+};
+
+inline footprint_recording& footprint_recorder() {
+    static thread_local footprint_recording recording;
+    return recording;
+}
+
+// Marks the segment of r between t0 and t1 in the current thread's footprint, if it records one
+inline void record_footprint(const ray& r, double t0, double t1) {
+    const footprint_recording& recording = footprint_recorder();
+    if (recording.cells != nullptr)
+        recording.grid->mark_segment(r, t0, t1, recording.cells);
+}
+
+#endif
@@ -0,0 +1,1148 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "main.h"
+#include "camera.h"
+#include "color.h"
+#include "denoiser.h"
+#include "frame_cache.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "parallel.h"
+#include "ray_footprint.h"
+#include "wavefront.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Order the tiles of a frame are handed out in
+enum class tile_order {
+    scanline,       // Row by row
+    morton,         // Z-order curve
+    hilbert         // Hilbert curve, consecutive tiles always share an edge
+};
+
+// Position of a tile on a Z-order curve
+inline uint64_t tile_morton_index(uint32_t x, uint32_t y) {
+    uint64_t code = 0;
+    for (int b = 0; b < 16; b++)
+        code |= (static_cast<uint64_t>((x >> b) & 1) << (2 * b)) | (static_cast<uint64_t>((y >> b) & 1) << (2 * b + 1));
+    return code;
+}
+
+// Position of a tile on a Hilbert curve covering an n x n grid, n a power of two
+inline uint64_t tile_hilbert_index(uint32_t n, uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+
+        // Rotate the quadrant so the curve inside it starts and ends at the right corners
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Tile based parallel renderer
+// A frame is cut into square tiles that run as tasks on the shared thread pool, ordered along
+// a space filling curve so tiles that run at the same time touch nearby parts of the scene.
+// Every pixel's average color goes to a float framebuffer, which is written out once the frame
+// is done. The renderer is kept across frames so its timing covers the whole animation.
+//
+// With adaptive sampling the frame is rendered in passes. Every pixel keeps a running mean and
+// variance of its luminance (Welford's algorithm); after a first pass of adaptive_min_samples,
+// only pixels whose relative standard error is still above adaptive_threshold get more samples,
+// until the frame's budget of samples_per_pixel per pixel is spent or every pixel converged.
+//
+// In temporal mode every pixel starts from the previous frame's estimate of the surface it
+// sees. A ray through each pixel center records the object, depth, normal and albedo it hits;
+// the hit point is projected through the previous camera to find the pixel it was seen at, and
+// that pixel's estimate is kept if it saw the same surface and its mean agrees with the first
+// pass of new samples. Adaptive sampling then spends little on pixels with good history.
+//
+// In incremental mode every tile records which primitives its paths were tested against, as a
+// bitset over the scene's primitives, and which cells of a coarse grid over the scene their
+// camera, bounce and shadow rays crossed (footprint_grid). When the next frame has the same
+// camera and settings, only tiles whose bitset holds a primitive that changed, whose rays
+// crossed a cell a changed primitive covers before or after the change, or that a changed
+// primitive covers on screen are rendered again; the other tiles keep the previous frame's
+// pixels. A light that came, went or changed lights every tile, so it renders them all. In a
+// closed room deep bounces reach most cells, so a moving object re-renders most of the image;
+// camera.record_depth trades that for speed by recording only the first bounces.
+//
+// With the primary cache, the camera rays of the first primary_cache_samples samples of every
+// pixel are the same on every frame, and the renderer keeps which primitive each of them hits
+// first. While the camera holds still, a kept sample tests its camera ray against that one
+// primitive instead of the whole scene; entries a moved primitive covers on screen, before or
+// after the move, are traced again. Camera rays that pass through a medium, whose hits are
+// drawn at random, are not kept.
+//
+// In wavefront mode a tile's samples are traced by a wavefront_integrator: the tile's camera
+// rays go into queues of up to wavefront_paths paths, which advance one bounce at a time with
+// their hits shaded in material order. Each pool thread keeps its own integrator, so tiles
+// still run in parallel, and the image is the same as the depth first integrator's. The camera
+// rays are made packet_size x packet_size pixels at a time and traced as packets, as are the
+// shadow rays.
+class renderer {
+  public:
+    int tile_size = 16;                         // Width and height of a tile in pixels
+    tile_order order = tile_order::hilbert;     // Order the tiles are handed out in
+    bool sample_lights = true;                  // Sample emissive quads and spheres at every diffuse hit
+    sampler_type sampler = sampler_type::sobol; // Sequence the samples of a pixel draw from
+
+    bool adaptive_sampling = false;             // Spend the sample budget where pixels are still noisy
+    double adaptive_threshold = 0.05;           // Relative standard error at which a pixel stops sampling
+    int adaptive_min_samples = 16;              // Samples every pixel gets before its error is trusted
+    int adaptive_pass_samples = 16;             // Most samples an unconverged pixel gets per pass
+    int adaptive_max_factor = 8;                // A pixel takes at most this many times samples_per_pixel
+
+    bool temporal = false;                      // Start every pixel from the previous frame's samples of its surface
+    double temporal_history_factor = 4.0;       // History a pixel keeps, in multiples of samples_per_pixel
+    double temporal_rejection_sigma = 4.0;      // History further than this many standard errors from the new samples is dropped
+    double temporal_position_tolerance = 1.0;   // Distance, in pixel footprints at the surface's depth, at which a reprojected hit point is another one
+    double temporal_normal_tolerance = 0.9;     // Cosine between normals below which a reprojected surface is another one
+
+    bool incremental = false;                   // Only render again the tiles the primitives changed since the last frame reach
+
+    bool primary_cache = false;                 // Keep the first hit of the camera rays across frames while the camera holds still
+    int primary_cache_samples = 32;             // Samples of a pixel whose first hit is kept
+
+    bool wavefront = false;                     // Trace a tile's paths bounce by bounce in queues, shaded in material order
+    int wavefront_paths = 4096;                 // Most paths a tile traces at once in wavefront mode
+    int packet_size = 8;                        // Side of the pixel blocks whose camera rays wavefront mode traces as one packet, 1 to 8
+
+    bool denoise = false;                       // Filter every frame once it is sampled
+    denoiser filter;                            // Filter used when denoise is set
+
+    frame_cache cache;                          // Frames rendered before, copied instead of rendered again
+
+    std::vector<float> framebuffer;             // Average linear color of each pixel, rgb, top row first
+    int width = 0;
+    int height = 0;
+
+    // Renders one frame into the framebuffer
+    void render(const camera& cam, const hittable& world, int image_width, int image_height,
+                int samples_per_pixel, int max_depth) {
+        material_table::read_scope reading(scene_materials());
+        bool same_size = image_width == width && image_height == height;
+        width = image_width;
+        height = image_height;
+
+        // A frame whose scene and settings hash to a frame on disk is copied from there. What
+        // the temporal and incremental modes keep stays that of the last frame rendered.
+        uint64_t key = 0;
+        frame_cached = false;
+        if (cache.enabled()) {
+            key = frame_key(cam, world, samples_per_pixel, max_depth);
+            if (cache.load(key, width, height, framebuffer)) {
+                frame_cached = true;
+                frame_samples = 0;
+                frame_redrawn = 0.0;
+                cached_frames++;
+                frame++;
+                return;
+            }
+        }
+
+        framebuffer.assign(static_cast<size_t>(width) * height * 3, 0.0f);
+
+        lights.clear();
+        if (sample_lights)
+            world.collect_lights(lights);
+
+        size_t pixels = static_cast<size_t>(width) * height;
+        estimates.assign(pixels, pixel_estimate());
+        active.assign(pixels, 1);
+        redraw.assign(pixels, 1);
+        features.assign(denoise ? pixels : 0, pixel_features());
+
+        std::vector<tile> tiles = make_tiles();
+        thread_pool& pool = global_thread_pool();
+        std::vector<double> busy(pool.size(), 0.0);
+
+        auto frame_start = std::chrono::steady_clock::now();
+
+        // What changed since the last frame, for the tiles and first hits that are kept
+        bool track = incremental || primary_cache;
+        scene_primitives.clear();
+        if (track)
+            world.collect_primitives(scene_primitives);
+        random_bounds.clear();
+        for (const hittable* object : scene_primitives) {
+            if (!object->hits_at_random()) continue;
+            aabb box = object->bounding_box();
+            random_bounds.push_back(aabb(box.x.expand(1e-3 * box.x.size() + 1e-6),
+                                         box.y.expand(1e-3 * box.y.size() + 1e-6),
+                                         box.z.expand(1e-3 * box.z.size() + 1e-6)));
+        }
+        bool same_view = !scene_primitives.empty() && same_size && previous_camera &&
+                         previous_camera->same_view(cam) && samples_per_pixel == previous_samples;
+        scene_change change;
+        if (same_view)
+            find_changes(cam, change);
+
+        if (primary_cache) {
+            size_t entries = pixels * std::max(primary_cache_samples, 0);
+            if (same_view && sampler == previous_sampler && first_hits.size() == entries)
+                update_first_hits(change);
+            else
+                first_hits.assign(entries, kNoPrimitive);
+        }
+
+        // Tiles to render: all of them, or the ones the scene's changes reach
+        std::vector<uint8_t> dirty(tiles.size(), 1);
+        if (incremental) {
+            bool reuse_tiles = same_view && max_depth == previous_depth && previous_estimates.size() == pixels &&
+                               previous_features.size() == features.size() && !change.everywhere &&
+                               touched.size() == tiles.size() * primitive_words &&
+                               footprints.size() == tiles.size() * footprint_grid::kWords;
+            if (reuse_tiles) {
+                find_dirty_tiles(tiles, change, dirty);
+            } else {
+                primitive_words = (scene_primitives.size() + 63) / 64;
+                touched.assign(tiles.size() * primitive_words, 0);
+                grid.reset(world.bounding_box());
+                footprints.assign(tiles.size() * footprint_grid::kWords, 0);
+            }
+
+            // Tiles that stay keep the previous frame's pixels
+            for (size_t t = 0; t < tiles.size(); t++) {
+                if (dirty[t]) continue;
+                for (int row = tiles[t].y0; row < tiles[t].y1; row++) {
+                    for (int i = tiles[t].x0; i < tiles[t].x1; i++) {
+                        size_t p = static_cast<size_t>(row) * width + i;
+                        estimates[p] = previous_estimates[p];
+                        if (denoise) features[p] = previous_features[p];
+                        active[p] = 0;
+                        redraw[p] = 0;
+                    }
+                }
+            }
+        }
+
+        if (track)
+            remember_primitives();
+
+        std::vector<int> work;
+        for (size_t t = 0; t < tiles.size(); t++)
+            if (dirty[t]) work.push_back(static_cast<int>(t));
+        uint64_t redrawn = 0;
+        for (size_t p = 0; p < pixels; p++)
+            redrawn += redraw[p];
+
+        // History of the previous frame, reprojected onto this one's surfaces
+        bool reuse = temporal && same_size && previous_camera && history.size() == pixels;
+        if (temporal) {
+            trace_surfaces(cam, world, surfaces);
+            if (reuse) reproject_history(cam);
+            else       prior.assign(pixels, pixel_estimate());
+            // Pixels kept from the previous frame already hold their history
+            for (size_t p = 0; p < pixels; p++)
+                if (!redraw[p]) prior[p] = pixel_estimate();
+        } else {
+            prior.clear();
+        }
+
+        std::vector<uint64_t> cached(pool.size(), 0);
+        if (wavefront)
+            integrators.resize(pool.size());
+        depth_first_counts.resize(std::max(depth_first_counts.size(), static_cast<size_t>(pool.size())));
+        auto run_pass = [&](int pass_samples) {
+            pool.run(static_cast<int>(work.size()), [&](int w, int thread) {
+                auto tile_start = std::chrono::steady_clock::now();
+                int t = work[w];
+                uint64_t* record = primitive_words > 0 && incremental ? &touched[t * primitive_words] : nullptr;
+                footprint_recorder().grid = &grid;
+                footprint_recorder().cells = record != nullptr ? &footprints[t * footprint_grid::kWords] : nullptr;
+                cached[thread] += wavefront
+                    ? render_tile_wavefront(integrators[thread], tiles[t], record, cam, world, pass_samples, samples_per_pixel, max_depth)
+                    : render_tile(tiles[t], record, cam, world, pass_samples, samples_per_pixel, max_depth);
+                footprint_recorder().cells = nullptr;
+                depth_first_counts[thread].add(thread_ray_counts());
+                thread_ray_counts() = ray_counts();
+                busy[thread] += std::chrono::duration<double>(std::chrono::steady_clock::now() - tile_start).count();
+            });
+        };
+
+        // The first pass samples every pixel, uniform sampling stops there
+        uint64_t budget = redrawn * samples_per_pixel;
+        int first_pass = adaptive_sampling ? std::min(samples_per_pixel, std::max(adaptive_min_samples, 2)) : samples_per_pixel;
+        run_pass(first_pass);
+        uint64_t used = redrawn * first_pass;
+
+        // History whose lighting the new samples disagree with is dropped
+        if (reuse) {
+            uint64_t kept = 0;
+            for (size_t p = 0; p < pixels; p++) {
+                if (prior[p].count > 0 && !prior[p].agrees_with(estimates[p], temporal_rejection_sigma))
+                    prior[p] = pixel_estimate();
+                kept += prior[p].count > 0;
+            }
+            history_pixels += kept;
+            history_candidates += redrawn;
+        }
+
+        // Later passes share what is left of the budget between the pixels that are still noisy
+        uint32_t max_samples = static_cast<uint32_t>(samples_per_pixel) * std::max(adaptive_max_factor, 1);
+        while (adaptive_sampling && used < budget) {
+            uint64_t noisy = 0;
+            for (size_t p = 0; p < pixels; p++) {
+                active[p] = redraw[p] && estimates[p].count < max_samples && combined(p).relative_error() > adaptive_threshold;
+                noisy += active[p];
+            }
+            if (noisy == 0) break;
+
+            uint64_t share = std::min<uint64_t>((budget - used) / noisy, std::max(adaptive_pass_samples, 1));
+            if (share == 0) break;
+
+            run_pass(static_cast<int>(share));
+            used += noisy * share;
+        }
+
+        // From here on a pixel's estimate includes the history it kept
+        if (temporal) {
+            for (size_t p = 0; p < pixels; p++)
+                estimates[p] = combined(p);
+        }
+
+        double frame_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frame_start).count();
+
+        // Resolve the framebuffer and the error of every pixel
+        uint64_t converged = 0;
+        double error_sum = 0.0;
+        for (size_t p = 0; p < pixels; p++) {
+            const pixel_estimate& e = estimates[p];
+            for (int c = 0; c < 3; c++)
+                framebuffer[3 * p + c] = static_cast<float>(e.count > 0 ? e.sum[c] / e.count : 0.0);
+
+            double error = e.relative_error();
+            converged += error <= adaptive_threshold;
+            error_sum += error < kMaxReportedError ? error : kMaxReportedError;
+        }
+
+        // Keep this frame as the next one's history, limited to temporal_history_factor times
+        // samples_per_pixel samples a pixel
+        if (temporal) {
+            uint32_t cap = static_cast<uint32_t>(std::max(temporal_history_factor, 0.0) * samples_per_pixel);
+            history = estimates;
+            for (pixel_estimate& h : history)
+                h.limit(cap);
+            previous_surfaces.swap(surfaces);
+        }
+
+        // Keep this frame for the next one to copy its tiles and first hits from
+        if (incremental) {
+            previous_estimates = estimates;
+            previous_features = features;
+        }
+        previous_samples = samples_per_pixel;
+        previous_depth = max_depth;
+        previous_sampler = sampler;
+        if (temporal || track)
+            previous_camera.reset(new camera(cam));
+
+        if (denoise)
+            denoise_frame();
+
+        if (cache.enabled())
+            cache.store(key, width, height, framebuffer);
+
+        threads = pool.size();
+        wall_seconds += frame_seconds;
+        for (double b : busy)
+            busy_seconds += b;
+
+        frame_samples = used;
+        frame_redrawn = static_cast<double>(redrawn) / pixels;
+        for (uint64_t c : cached)
+            cached_camera_rays += c;
+        redrawn_pixels += redrawn;
+        total_samples += used;
+        total_budget += budget;
+        converged_pixels += converged;
+        total_pixels += pixels;
+        error_total += error_sum;
+
+        frame++;
+    }
+
+    // Writes the framebuffer as a plain text PPM, bottom row of the scene last
+    void write_ppm(std::ostream& out) const {
+        out << "P3\n" << width << ' ' << height << "\n255\n";
+        for (size_t p = 0; p < static_cast<size_t>(width) * height; p++)
+            write_color(out, color(framebuffer[3 * p], framebuffer[3 * p + 1], framebuffer[3 * p + 2]), 1);
+    }
+
+    // Writes the relative standard error of every pixel as a grey scale PPM
+    // Black is noise free, white is twice the adaptive threshold or more.
+    void write_error_map(std::ostream& out) const {
+        out << "P3\n" << width << ' ' << height << "\n255\n";
+        for (const pixel_estimate& e : estimates) {
+            int level = static_cast<int>(255.999 * std::min(e.relative_error() / (2.0 * adaptive_threshold), 1.0));
+            out << level << ' ' << level << ' ' << level << '\n';
+        }
+    }
+
+    // Camera samples taken for the last frame
+    uint64_t last_frame_samples() const { return frame_samples; }
+
+    // Camera samples taken over all frames, and what uniform sampling would have taken
+    uint64_t samples_taken() const { return total_samples; }
+    uint64_t sample_budget() const { return total_budget; }
+
+    // Fraction of all pixels rendered whose relative error ended at or below the threshold
+    double converged_fraction() const {
+        return total_pixels > 0 ? static_cast<double>(converged_pixels) / total_pixels : 0.0;
+    }
+
+    // Relative standard error of the pixels' luminance, averaged over every pixel rendered
+    double mean_relative_error() const {
+        return total_pixels > 0 ? error_total / total_pixels : 0.0;
+    }
+
+    // Fraction of pixels that kept history, over all frames that had a previous frame
+    double history_reuse() const {
+        return history_candidates > 0 ? static_cast<double>(history_pixels) / history_candidates : 0.0;
+    }
+
+    // Fraction of the last frame's pixels that were rendered, not kept from the frame before
+    double last_frame_redrawn() const { return frame_redrawn; }
+
+    // Fraction of all pixels that were rendered, over all frames
+    double redrawn_fraction() const {
+        return total_pixels > 0 ? static_cast<double>(redrawn_pixels) / total_pixels : 0.0;
+    }
+
+    // Whether the last frame was copied from the frame cache instead of rendered
+    bool last_frame_cached() const { return frame_cached; }
+
+    // Frames copied from the frame cache
+    uint64_t frames_from_cache() const { return cached_frames; }
+
+    // Fraction of all camera samples whose first hit came from the primary cache
+    double primary_cache_reuse() const {
+        return total_samples > 0 ? static_cast<double>(cached_camera_rays) / total_samples : 0.0;
+    }
+
+    // Time spent denoising, over all frames
+    double denoise_time() const { return denoise_seconds; }
+
+    // Camera rays traced through the scene per second of a thread's time tracing them, by
+    // either integrator, over all frames
+    double primary_ray_rate() const {
+        uint64_t rays = 0;
+        double seconds = 0.0;
+        for (const ray_counts& counts : depth_first_counts) {
+            rays += counts.primary_rays;
+            seconds += counts.primary_seconds;
+        }
+        for (const auto& paths : integrators) {
+            rays += paths.primary_rays();
+            seconds += paths.primary_seconds();
+        }
+        return seconds > 0 ? rays / seconds : 0.0;
+    }
+
+    // Scattered and shadow rays traced per second of a thread's time tracing them
+    double secondary_ray_rate() const {
+        uint64_t rays = 0;
+        double seconds = 0.0;
+        for (const ray_counts& counts : depth_first_counts) {
+            rays += counts.secondary_rays;
+            seconds += counts.secondary_seconds;
+        }
+        for (const auto& paths : integrators) {
+            rays += paths.secondary_rays();
+            seconds += paths.secondary_seconds();
+        }
+        return seconds > 0 ? rays / seconds : 0.0;
+    }
+
+    // Fraction of the camera and shadow rays traced in wavefront mode that went in packets
+    double packet_fraction() const {
+        uint64_t packeted = 0;
+        uint64_t rays = 0;
+        for (const auto& paths : integrators) {
+            packeted += paths.packet_rays_traced();
+            rays += paths.primary_rays() + paths.shadow_rays();
+        }
+        return rays > 0 ? static_cast<double>(packeted) / rays : 0.0;
+    }
+
+    // Threads used for the last frame
+    int thread_count() const { return threads; }
+
+    // Time spent rendering tiles summed over all threads, divided by threads times wall time
+    // 1 means every thread was busy for the whole of every frame.
+    double parallel_efficiency() const {
+        return wall_seconds > 0 && threads > 0 ? busy_seconds / (threads * wall_seconds) : 0.0;
+    }
+
+  private:
+    struct tile {
+        int x0, y0, x1, y1;     // Pixel range [x0, x1) x [y0, y1), rows counted from the top
+    };
+
+    // Running estimate of one pixel
+    struct pixel_estimate {
+        uint32_t count = 0;                 // Samples taken
+        double sum[3] = {0.0, 0.0, 0.0};    // Sum of the sample colors
+        double mean = 0.0;                  // Mean luminance
+        double m2 = 0.0;                    // Sum of squared luminance deviations from the mean
+
+        void add(const color& c) {
+            for (int k = 0; k < 3; k++)
+                sum[k] += c[k];
+
+            double y = 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+            count++;
+            double delta = y - mean;
+            mean += delta / count;
+            m2 += delta * (y - mean);
+        }
+
+        // Adds the samples of another estimate (Chan et al.'s pairwise update)
+        void merge(const pixel_estimate& other) {
+            if (other.count == 0) return;
+            if (count == 0) {
+                *this = other;
+                return;
+            }
+
+            double n = static_cast<double>(count) + other.count;
+            double delta = other.mean - mean;
+            for (int k = 0; k < 3; k++)
+                sum[k] += other.sum[k];
+            mean += delta * other.count / n;
+            m2 += other.m2 + delta * delta * count * other.count / n;
+            count += other.count;
+        }
+
+        // Scales the estimate down to at most max_count samples, keeping its mean and variance
+        // Older samples then fade out as new ones are merged in.
+        void limit(uint32_t max_count) {
+            if (count <= max_count) return;
+            double scale = static_cast<double>(max_count) / count;
+            for (int k = 0; k < 3; k++)
+                sum[k] *= scale;
+            m2 *= scale;
+            count = max_count;
+        }
+
+        // Whether the mean luminance of other is within sigma combined standard errors of this
+        // one's, a relative margin covers estimates with too few samples to show their noise
+        bool agrees_with(const pixel_estimate& other, double sigma) const {
+            if (count < 2 || other.count < 2) return true;
+            double variance = m2 / (count - 1) / count + other.m2 / (other.count - 1) / other.count;
+            return std::fabs(mean - other.mean) <= sigma * std::sqrt(variance) + 0.02 * std::max(mean, other.mean);
+        }
+
+        // Standard error of the mean luminance relative to the mean
+        // Dark pixels are measured against a floor so their error does not blow up near zero.
+        double relative_error() const {
+            if (count < 2) return infinity;
+            double standard_error = std::sqrt(m2 / (count - 1) / count);
+            return standard_error / (mean > kLuminanceFloor ? mean : kLuminanceFloor);
+        }
+    };
+
+    // Sums of the denoiser features of one pixel's samples
+    struct pixel_features {
+        uint32_t count = 0;
+        double albedo[3] = {0.0, 0.0, 0.0};
+        double normal[3] = {0.0, 0.0, 0.0};
+
+        void add(const surface_features& f) {
+            count++;
+            for (int k = 0; k < 3; k++) {
+                albedo[k] += f.albedo[k];
+                normal[k] += f.normal[k];
+            }
+        }
+    };
+
+    // What the center of a pixel sees, compared across frames to decide if history still applies
+    struct pixel_surface {
+        const hittable* object = nullptr;   // Primitive hit, nullptr for the background
+        point3 position;                    // Hit point
+        double depth = 0.0;                 // Distance from the camera
+        vec3 normal;
+        color albedo;
+    };
+
+    static constexpr double kLuminanceFloor = 0.01;
+    static constexpr double kMaxReportedError = 1.0;   // Caps a pixel's share of the mean error
+
+    std::vector<const hittable*> lights;    // Lights of the frame being rendered
+    std::vector<pixel_estimate> estimates;  // Running estimate of every pixel of the frame
+    std::vector<uint8_t> active;            // Pixels sampled by the current pass
+    std::vector<pixel_features> features;   // Denoiser features of every pixel, when denoising
+    std::vector<pixel_estimate> prior;      // History each pixel starts from, when temporal
+    std::vector<pixel_estimate> history;    // Estimates of the previous frame, limited in size
+    std::vector<pixel_surface> surfaces;    // Surface at the center of every pixel
+    std::vector<pixel_surface> previous_surfaces;
+    std::unique_ptr<camera> previous_camera;
+    std::vector<uint8_t> redraw;            // Pixels rendered this frame, the others are kept
+    std::vector<pixel_estimate> previous_estimates; // Pixels of the previous frame, when incremental
+    std::vector<pixel_features> previous_features;
+    std::vector<const hittable*> scene_primitives;  // Scene primitives, in the order hit_record::primitive counts
+    std::vector<const hittable*> primitives;        // Scene primitives of the previous frame
+    std::vector<uint64_t> primitive_revisions;      // Their revisions
+    std::vector<aabb> primitive_bounds;             // Their bounds
+    std::vector<uint8_t> primitive_lights;          // Whether each of them was a light
+    std::vector<const hittable*> previous_lights;   // Lights of the previous frame
+    std::vector<uint64_t> touched;          // Primitives each tile's paths were tested against, primitive_words a tile
+    size_t primitive_words = 0;
+    footprint_grid grid;                    // Grid over the scene the tiles' footprints are kept in
+    std::vector<uint64_t> footprints;       // Cells each tile's rays crossed, footprint_grid::kWords a tile
+    std::vector<uint32_t> first_hits;       // Primitive each cached camera ray hits, primary_cache_samples a pixel
+    std::vector<aabb> random_bounds;        // Boxes of the primitives hit at random, grown a little
+    hittable_list nothing;                  // What a camera ray that hit nothing is tested against
+    std::vector<wavefront_integrator> integrators; // Path queues of each pool thread, in wavefront mode
+    std::vector<ray_counts> depth_first_counts;    // Rays each pool thread traced depth first
+    int previous_samples = 0;
+    int previous_depth = 0;
+    sampler_type previous_sampler = sampler_type::independent;
+    double pixel_angle = 0.0;               // Angle a pixel covers near the image center
+    int threads = 0;
+    uint32_t frame = 0;             // Frames rendered so far, part of every sample's random seed
+    double wall_seconds = 0.0;      // Wall time of all frames
+    double busy_seconds = 0.0;      // Time threads spent in tiles, over all frames
+    double denoise_seconds = 0.0;   // Time spent in the denoiser, over all frames
+
+    uint64_t frame_samples = 0;     // Samples of the last frame
+    uint64_t total_samples = 0;     // Samples of all frames
+    uint64_t total_budget = 0;      // samples_per_pixel times pixels, over all frames
+    uint64_t converged_pixels = 0;  // Pixels that ended at or below the threshold, over all frames
+    uint64_t total_pixels = 0;
+    double error_total = 0.0;       // Sum of the pixels' capped relative errors, over all frames
+    uint64_t history_pixels = 0;    // Pixels that kept history, over all frames
+    uint64_t history_candidates = 0; // Pixels of frames that had history to reproject
+    uint64_t redrawn_pixels = 0;    // Pixels rendered, not kept from the frame before, over all frames
+    uint64_t cached_camera_rays = 0; // Camera samples whose first hit came from the primary cache
+    double frame_redrawn = 0.0;
+    bool frame_cached = false;
+    uint64_t cached_frames = 0;     // Frames copied from the frame cache
+
+    // Version of the pixels the renderer makes of a scene, part of every frame_key()
+    // Raise it with any change to the renderer, camera, materials or shapes that changes the
+    // image of a scene, so frames an older build left in the frame cache are not copied.
+    enum : uint32_t { kRenderVersion = 1 };
+
+    // Hash of everything a frame's pixels depend on: the scene, the camera and the settings
+    // that change the estimate
+    // The history a temporal frame starts from is left out, so a temporal frame is copied
+    // whenever its own scene was rendered before, whatever came before it. The integrator is
+    // in, although both make the same image, so a frame is only ever copied from its own.
+    uint64_t frame_key(const camera& cam, const hittable& world, int samples_per_pixel, int max_depth) const {
+        state_hasher h;
+        h.add("frame");
+        h.add(kRenderVersion);
+        h.add(width);
+        h.add(height);
+        h.add(samples_per_pixel);
+        h.add(max_depth);
+        h.add(sample_lights);
+        h.add(static_cast<int>(sampler));
+        h.add(adaptive_sampling);
+        if (adaptive_sampling) {
+            h.add(adaptive_threshold);
+            h.add(adaptive_min_samples);
+            h.add(adaptive_pass_samples);
+            h.add(adaptive_max_factor);
+        }
+        h.add(temporal);
+        if (temporal) {
+            h.add(temporal_history_factor);
+            h.add(temporal_rejection_sigma);
+            h.add(temporal_position_tolerance);
+            h.add(temporal_normal_tolerance);
+        }
+        h.add(incremental);
+        h.add(wavefront);
+        h.add(primary_cache);
+        if (primary_cache)
+            h.add(primary_cache_samples);
+        h.add(denoise);
+        if (denoise) {
+            h.add(filter.iterations);
+            h.add(filter.sigma_normal);
+            h.add(filter.sigma_albedo);
+            h.add(filter.sigma_luminance);
+        }
+        cam.hash_state(h);
+        world.hash_state(h);
+        return h.value();
+    }
+
+    // Cuts the image into tiles and sorts them along the configured curve
+    std::vector<tile> make_tiles() const {
+        int size = std::max(tile_size, 1);
+        uint32_t tiles_x = (width + size - 1) / size;
+        uint32_t tiles_y = (height + size - 1) / size;
+
+        uint32_t n = 1;
+        while (n < tiles_x || n < tiles_y) n *= 2;
+
+        std::vector<std::pair<uint64_t, tile>> keyed;
+        keyed.reserve(static_cast<size_t>(tiles_x) * tiles_y);
+        for (uint32_t ty = 0; ty < tiles_y; ty++) {
+            for (uint32_t tx = 0; tx < tiles_x; tx++) {
+                tile t;
+                t.x0 = tx * size;
+                t.y0 = ty * size;
+                t.x1 = std::min(width, t.x0 + size);
+                t.y1 = std::min(height, t.y0 + size);
+
+                uint64_t key = ty * tiles_x + tx;
+                if (order == tile_order::morton) key = tile_morton_index(tx, ty);
+                else if (order == tile_order::hilbert) key = tile_hilbert_index(n, tx, ty);
+                keyed.push_back(std::make_pair(key, t));
+            }
+        }
+
+        std::sort(keyed.begin(), keyed.end(), [](const std::pair<uint64_t, tile>& a, const std::pair<uint64_t, tile>& b) {
+            return a.first < b.first;
+        });
+
+        std::vector<tile> tiles;
+        tiles.reserve(keyed.size());
+        for (const auto& k : keyed)
+            tiles.push_back(k.second);
+        return tiles;
+    }
+
+    // Entries of first_hits that are not primitive positions
+    enum : uint32_t {
+        kNoPrimitive = 0xffffffff,  // First hit not known, or its primitive is gone
+        kHitNothing = 0xfffffffe,   // Camera ray that hits nothing
+        kNotCached = 0xfffffffd     // Camera ray that enters an object hit at random, traced every time
+    };
+
+    // Differences between the primitives of the previous frame and scene_primitives
+    struct scene_change {
+        std::vector<uint64_t> changed;      // Previous primitives that moved or went away, a bit each
+        std::vector<uint32_t> new_slot;     // Position of each previous primitive now, kNoPrimitive when gone
+        std::vector<int> rects;             // Screen rectangles of moved primitives, before and after, from screen_rect()
+        std::vector<uint64_t> cells;        // Footprint cells moved primitives cover, before and after
+        bool everywhere = false;            // A moved primitive reaches behind the camera or out of the grid
+        bool lighting = false;              // A light came, went or changed, which any path may see
+    };
+
+    // Finds the primitives that moved, turned, came or went since the last frame
+    void find_changes(const camera& cam, scene_change& change) const {
+        std::unordered_map<const hittable*, uint32_t> slot_of;
+        for (size_t s = 0; s < scene_primitives.size(); s++)
+            slot_of[scene_primitives[s]] = static_cast<uint32_t>(s);
+        std::unordered_map<const hittable*, uint32_t> previous_slot_of;
+        for (size_t s = 0; s < primitives.size(); s++)
+            previous_slot_of[primitives[s]] = static_cast<uint32_t>(s);
+
+        change.changed.assign((primitives.size() + 63) / 64, 0);
+        change.new_slot.assign(primitives.size(), kNoPrimitive);
+        change.lighting = lights != previous_lights;
+        std::vector<aabb> moved;
+        for (size_t s = 0; s < primitives.size(); s++) {
+            auto found = slot_of.find(primitives[s]);
+            if (found != slot_of.end())
+                change.new_slot[s] = found->second;
+            if (found == slot_of.end() || scene_primitives[found->second]->revision() != primitive_revisions[s]) {
+                change.changed[s >> 6] |= 1ull << (s & 63);
+                change.lighting = change.lighting || primitive_lights[s];
+                moved.push_back(primitive_bounds[s]);
+            }
+        }
+        for (const hittable* object : scene_primitives) {
+            auto found = previous_slot_of.find(object);
+            if (found == previous_slot_of.end() || object->revision() != primitive_revisions[found->second]) {
+                change.lighting = change.lighting || object->is_light();
+                moved.push_back(object->bounding_box());
+            }
+        }
+
+        change.cells.assign(footprint_grid::kWords, 0);
+        for (const aabb& box : moved) {
+            int rect[4];
+            if (!screen_rect(cam, box, rect) || !grid.contains(box)) {
+                change.everywhere = true;
+                break;
+            }
+            change.rects.insert(change.rects.end(), rect, rect + 4);
+            grid.mark_box(box, change.cells.data());
+        }
+    }
+
+    // Marks the tiles that have to be rendered again: the ones whose paths tested a primitive
+    // that changed or went away, the ones whose rays crossed a cell a changed primitive covers,
+    // and the ones a changed or new primitive covers on screen; every tile when a light changed
+    // Then lays the bitsets of the kept tiles out for the new primitives, and clears the
+    // footprints of the tiles rendered again.
+    void find_dirty_tiles(const std::vector<tile>& tiles, const scene_change& change, std::vector<uint8_t>& dirty) {
+        std::fill(dirty.begin(), dirty.end(), change.everywhere || change.lighting ? 1 : 0);
+
+        size_t words = (scene_primitives.size() + 63) / 64;
+        std::vector<uint64_t> relaid(tiles.size() * words, 0);
+        for (size_t t = 0; t < tiles.size(); t++) {
+            const uint64_t* bits = &touched[t * primitive_words];
+            uint64_t* cells = &footprints[t * footprint_grid::kWords];
+            for (size_t k = 0; k < primitive_words && !dirty[t]; k++)
+                dirty[t] = (bits[k] & change.changed[k]) != 0;
+            for (int k = 0; k < footprint_grid::kWords && !dirty[t]; k++)
+                dirty[t] = (cells[k] & change.cells[k]) != 0;
+            for (size_t r = 0; r < change.rects.size() && !dirty[t]; r += 4)
+                dirty[t] = change.rects[r] < tiles[t].x1 && change.rects[r + 2] >= tiles[t].x0 &&
+                           change.rects[r + 1] < tiles[t].y1 && change.rects[r + 3] >= tiles[t].y0;
+            if (dirty[t]) {
+                std::fill(cells, cells + footprint_grid::kWords, 0);
+                continue;
+            }
+
+            // A kept tile's paths tested the same primitives, now at their new bits
+            for (size_t s = 0; s < primitives.size(); s++) {
+                if (!(bits[s >> 6] & (1ull << (s & 63)))) continue;
+                uint32_t slot = change.new_slot[s];
+                relaid[t * words + (slot >> 6)] |= 1ull << (slot & 63);
+            }
+        }
+
+        touched.swap(relaid);
+        primitive_words = words;
+    }
+
+    // Forgets the cached first hits a moved primitive may have changed, and renumbers the others
+    // for the new primitive order
+    void update_first_hits(const scene_change& change) {
+        if (change.everywhere) {
+            std::fill(first_hits.begin(), first_hits.end(), kNoPrimitive);
+            return;
+        }
+
+        bool renumber = primitives.size() != scene_primitives.size();
+        for (size_t s = 0; s < change.new_slot.size() && !renumber; s++)
+            renumber = change.new_slot[s] != s;
+        if (renumber) {
+            parallel_for(first_hits.size(), [&](size_t k) {
+                if (first_hits[k] < kNotCached)
+                    first_hits[k] = change.new_slot[first_hits[k]];
+            });
+        }
+
+        size_t samples = static_cast<size_t>(primary_cache_samples);
+        for (size_t r = 0; r < change.rects.size(); r += 4) {
+            for (int y = std::max(change.rects[r + 1], 0); y <= std::min(change.rects[r + 3], height - 1); y++) {
+                for (int x = std::max(change.rects[r], 0); x <= std::min(change.rects[r + 2], width - 1); x++) {
+                    size_t p = static_cast<size_t>(y) * width + x;
+                    std::fill(first_hits.begin() + p * samples, first_hits.begin() + (p + 1) * samples, kNoPrimitive);
+                }
+            }
+        }
+    }
+
+    // Object the camera ray r of a cached sample hits first: the one in its entry, or the one
+    // found by tracing r, which is stored there
+    // A ray that enters the box of an object hit at random, a medium, before its first hit
+    // may hit something else on the next frame; it is not cached and nullptr is returned. The
+    // object is added to record, unless it is nullptr.
+    const hittable* first_hit(uint32_t& entry, const ray& r, const hittable& world, uint64_t* record) const {
+        if (entry == kNoPrimitive) {
+            hit_record rec;
+            bool hit_anything = world.hit(r, interval(0.001, infinity), rec);
+            entry = hit_anything ? rec.primitive : kHitNothing;
+            interval before_hit(0.001, hit_anything ? rec.t : infinity);
+            for (const aabb& box : random_bounds)
+                if (box.hit(r, before_hit)) entry = kNotCached;
+        }
+        if (entry == kNotCached)
+            return nullptr;
+        if (entry == kHitNothing)
+            return &nothing;
+
+        if (record != nullptr)
+            record[entry >> 6] |= 1ull << (entry & 63);
+        return scene_primitives[entry];
+    }
+
+    // Stores the scene's primitives to find what changed by the next frame
+    void remember_primitives() {
+        primitives = scene_primitives;
+        primitive_revisions.clear();
+        primitive_bounds.clear();
+        primitive_lights.clear();
+        for (const hittable* object : primitives) {
+            primitive_revisions.push_back(object->revision());
+            primitive_bounds.push_back(object->bounding_box());
+            primitive_lights.push_back(object->is_light());
+        }
+        previous_lights = lights;
+    }
+
+    // Pixel rectangle x0, y0, x1, y1 (inclusive, rows from the top) a box covers on screen,
+    // false when part of the box is behind the camera
+    bool screen_rect(const camera& cam, const aabb& box, int rect[4]) const {
+        double x_min = infinity, x_max = -infinity, y_min = infinity, y_max = -infinity;
+        for (int corner = 0; corner < 8; corner++) {
+            point3 p((corner & 1) ? box.x.max : box.x.min,
+                     (corner & 2) ? box.y.max : box.y.min,
+                     (corner & 4) ? box.z.max : box.z.min);
+            double s, t;
+            if (!cam.project(p, s, t))
+                return false;
+            double x = s * (width-1);
+            double y = (height-1) - t * (height-1);
+            x_min = std::min(x_min, x);
+            x_max = std::max(x_max, x);
+            y_min = std::min(y_min, y);
+            y_max = std::max(y_max, y);
+        }
+
+        // A pixel's samples spread one pixel around it
+        rect[0] = static_cast<int>(std::floor(std::max(x_min - 1.0, -1.0)));
+        rect[1] = static_cast<int>(std::floor(std::max(y_min - 1.0, -1.0)));
+        rect[2] = static_cast<int>(std::ceil(std::min(x_max + 1.0, static_cast<double>(width))));
+        rect[3] = static_cast<int>(std::ceil(std::min(y_max + 1.0, static_cast<double>(height))));
+        return true;
+    }
+
+    // Estimate of a pixel with its history
+    pixel_estimate combined(size_t p) const {
+        if (prior.empty()) return estimates[p];
+        pixel_estimate e = prior[p];
+        e.merge(estimates[p]);
+        return e;
+    }
+
+    // Traces the ray through the center of every pixel and records what it hits first
+    void trace_surfaces(const camera& cam, const hittable& world, std::vector<pixel_surface>& out) {
+        out.assign(static_cast<size_t>(width) * height, pixel_surface());
+
+        // Angle between the center rays of neighbouring pixels
+        vec3 a = unit_vector(cam.get_center_ray(0.5 / (width-1), 0.5).direction());
+        vec3 b = unit_vector(cam.get_center_ray(1.5 / (width-1), 0.5).direction());
+        pixel_angle = (a - b).length();
+
+        parallel_for(static_cast<size_t>(height), [&](size_t row) {
+            int j = height - 1 - static_cast<int>(row);
+            for (int i = 0; i < width; i++) {
+                ray r = cam.get_center_ray((i + 0.5) / (width-1), (j + 0.5) / (height-1));
+                hit_record rec;
+                if (!world.hit(r, interval(0.001, infinity), rec))
+                    continue;
+
+                pixel_surface& s = out[row * width + i];
+                s.object = rec.object;
+                s.position = rec.p;
+                s.depth = rec.t * r.direction().length();
+                s.normal = rec.normal;
+                s.albedo = rec.mat()->surface_albedo(rec);
+            }
+        }, 8);
+    }
+
+    // Finds where each pixel's surface was on the previous frame's image and takes that pixel's
+    // history if the same surface was seen there
+    // The motion of a pixel is the difference between where its hit point projects through the
+    // current and the previous camera; objects that moved are caught by the surface test.
+    void reproject_history(const camera& cam) {
+        prior.assign(surfaces.size(), pixel_estimate());
+        parallel_for(static_cast<size_t>(height), [&](size_t row) {
+            for (int i = 0; i < width; i++) {
+                size_t p = row * width + i;
+                const pixel_surface& s = surfaces[p];
+
+                size_t q = p;
+                if (s.object != nullptr) {
+                    double u, v;
+                    if (!previous_camera->project(s.position, u, v))
+                        continue;
+                    int x = static_cast<int>(std::floor(u * (width-1)));
+                    int y = height - 1 - static_cast<int>(std::floor(v * (height-1)));
+                    if (x < 0 || x >= width || y < 0 || y >= height)
+                        continue;
+                    q = static_cast<size_t>(y) * width + x;
+                }
+
+                if (same_surface(s, previous_surfaces[q]))
+                    prior[p] = history[q];
+            }
+        }, 8);
+    }
+
+    // Whether two pixel surfaces are the same part of the same object, looking the same
+    bool same_surface(const pixel_surface& a, const pixel_surface& b) const {
+        if (a.object != b.object) return false;
+        if (a.object == nullptr) return true;
+
+        // The two center rays hit points at most a pixel apart on a static surface
+        double footprint = a.depth * pixel_angle;
+        vec3 albedo_change = a.albedo - b.albedo;
+        return (a.position - b.position).length() <= temporal_position_tolerance * footprint &&
+               dot(a.normal, b.normal) >= temporal_normal_tolerance &&
+               albedo_change.length_squared() <= 0.01;
+    }
+
+    // Runs the denoiser over the framebuffer, guided by the average features of every pixel
+    void denoise_frame() {
+        auto start = std::chrono::steady_clock::now();
+
+        size_t pixels = estimates.size();
+        std::vector<float> albedo(3 * pixels);
+        std::vector<float> normal(3 * pixels);
+        std::vector<float> variance(pixels);
+        for (size_t p = 0; p < pixels; p++) {
+            const pixel_estimate& e = estimates[p];
+            double n = std::max<uint32_t>(features[p].count, 1);
+            for (int k = 0; k < 3; k++) {
+                albedo[3 * p + k] = static_cast<float>(features[p].albedo[k] / n);
+                normal[3 * p + k] = static_cast<float>(features[p].normal[k] / n);
+            }
+            variance[p] = static_cast<float>(e.count > 1 ? e.m2 / (e.count - 1) / e.count : 0.0);
+        }
+
+        filter.apply(framebuffer, albedo, normal, variance, width, height);
+
+        denoise_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Adds pass_samples samples to every active pixel of a tile
+    // Samples are numbered per pixel across passes, so a pixel's random numbers do not depend on
+    // how its samples were split into passes or which thread took them.
+    // The primitives its paths are tested against are added to record, unless it is nullptr.
+    // Returns the number of samples whose first hit came from the primary cache.
+    uint64_t render_tile(const tile& t, uint64_t* record, const camera& cam, const hittable& world, int pass_samples,
+                         int samples_per_pixel, int max_depth) {
+        uint64_t cached = 0;
+        uint32_t cache_samples = primary_cache ? static_cast<uint32_t>(std::max(primary_cache_samples, 0)) : 0;
+        uint32_t static_dimensions = primary_cache ? camera::kCameraDimensions : 0;
+        for (int row = t.y0; row < t.y1; row++) {
+            // Image rows count from the top, the camera's v coordinate from the bottom
+            int j = height - 1 - row;
+
+            for (int i = t.x0; i < t.x1; i++) {
+                uint32_t pixel_index = static_cast<uint32_t>(row) * width + i;
+                if (!active[pixel_index]) continue;
+
+                pixel_estimate& estimate = estimates[pixel_index];
+                pixel_features* pixel_aux = denoise ? &features[pixel_index] : nullptr;
+                // Antialiasing requirement
+                for (int s = 0; s < pass_samples; ++s) {
+                    start_sample(sampler, frame, i, row, estimate.count, samples_per_pixel, static_dimensions);
+                    primitive_recorder() = record;
+                    auto u = (i + random_double()) / (width-1);
+                    auto v = (j + random_double()) / (height-1);
+                    ray r = cam.get_ray(u, v);
+
+                    // The first samples of a pixel start from the primitive their camera ray hit
+                    const hittable* first = nullptr;
+                    if (estimate.count < cache_samples) {
+                        uint32_t& entry = first_hits[static_cast<size_t>(pixel_index) * cache_samples + estimate.count];
+                        cached += entry != kNoPrimitive && entry != kNotCached;
+                        first = first_hit(entry, r, world, record);
+                    }
+
+                    if (pixel_aux != nullptr) {
+                        surface_features f;
+                        estimate.add(cam.ray_color(r, world, lights, max_depth, &f, first));
+                        pixel_aux->add(f);
+                    } else {
+                        estimate.add(cam.ray_color(r, world, lights, max_depth, nullptr, first));
+                    }
+                }
+            }
+        }
+        primitive_recorder() = nullptr;
+        return cached;
+    }
+
+    // render_tile() with the tile's paths traced by a wavefront integrator
+    // The tile is walked in blocks of packet_size x packet_size pixels, taking each sample of all
+    // the block's pixels before the next one, so consecutive camera rays form the packets. Every
+    // pixel still gets its samples in the order render_tile() gives them, whichever bounce the
+    // paths ended at.
+    uint64_t render_tile_wavefront(wavefront_integrator& paths, const tile& t, uint64_t* record, const camera& cam,
+                                   const hittable& world, int pass_samples, int samples_per_pixel, int max_depth) {
+        uint64_t cached = 0;
+        uint32_t cache_samples = primary_cache ? static_cast<uint32_t>(std::max(primary_cache_samples, 0)) : 0;
+        size_t batch = static_cast<size_t>(std::max(wavefront_paths, 1));
+        int side = std::min(std::max(packet_size, 1), 8);
+        paths.packet_rays = side * side;
+        paths.sampler = sampler;
+        paths.frame = frame;
+        paths.sample_count = static_cast<uint32_t>(samples_per_pixel);
+        paths.static_dimensions = primary_cache ? camera::kCameraDimensions : 0;
+        paths.clear();
+
+        auto trace_batch = [&]() {
+            paths.trace(cam, world, lights, max_depth, denoise, record);
+            for (size_t k = 0; k < paths.size(); k++) {
+                size_t pixel_index = static_cast<size_t>(paths.y(k)) * width + paths.x(k);
+                estimates[pixel_index].add(paths.radiance(k));
+                if (denoise)
+                    features[pixel_index].add(paths.features(k));
+            }
+            paths.clear();
+        };
+
+        for (int block_y = t.y0; block_y < t.y1; block_y += side) {
+            for (int block_x = t.x0; block_x < t.x1; block_x += side) {
+                int block_y1 = std::min(block_y + side, t.y1);
+                int block_x1 = std::min(block_x + side, t.x1);
+
+                // The pixels' samples may be split across batches, so they are numbered from the
+                // count each pixel had before this pass
+                uint32_t first_sample[64];
+                for (int row = block_y; row < block_y1; row++)
+                    for (int i = block_x; i < block_x1; i++)
+                        first_sample[(row - block_y) * side + (i - block_x)] = estimates[static_cast<size_t>(row) * width + i].count;
+
+                for (int s = 0; s < pass_samples; ++s) {
+                    for (int row = block_y; row < block_y1; row++) {
+                        // Image rows count from the top, the camera's v coordinate from the bottom
+                        int j = height - 1 - row;
+
+                        for (int i = block_x; i < block_x1; i++) {
+                            uint32_t pixel_index = static_cast<uint32_t>(row) * width + i;
+                            if (!active[pixel_index]) continue;
+
+                            uint32_t sample = first_sample[(row - block_y) * side + (i - block_x)] + s;
+                            start_sample(sampler, frame, i, row, sample, samples_per_pixel, paths.static_dimensions);
+                            primitive_recorder() = record;
+                            auto u = (i + random_double()) / (width-1);
+                            auto v = (j + random_double()) / (height-1);
+                            ray r = cam.get_ray(u, v);
+
+                            const hittable* first = nullptr;
+                            if (sample < cache_samples) {
+                                uint32_t& entry = first_hits[static_cast<size_t>(pixel_index) * cache_samples + sample];
+                                cached += entry != kNoPrimitive && entry != kNotCached;
+                                first = first_hit(entry, r, world, record);
+                            }
+
+                            paths.add(r, first, i, row, sample);
+                            if (paths.size() == batch)
+                                trace_batch();
+                        }
+                    }
+                }
+            }
+        }
+        if (paths.size() > 0)
+            trace_batch();
+        primitive_recorder() = nullptr;
+        return cached;
+    }
+};
+
+#endif
@@ -10,6 +10,8 @@
 #define STBI_FAILURE_USERMSG
 #include "../external/stb_image.h"
 
+#include "state_hash.h"
+
 #include <cstdlib>
 #include <iostream>
 
@@ -52,6 +54,14 @@ class rtw_image {
         return data != nullptr;
     }
 
+    // Adds the size and pixels of the image to a scene hash
+    void hash_state(state_hasher& h) const {
+        h.add(width());
+        h.add(height());
+        if (data != nullptr)
+            h.add_bytes(data, static_cast<size_t>(image_width) * image_height * bytes_per_pixel);
+    }
+
     int width()  const { return (data == nullptr) ? 0 : image_width; }
     int height() const { return (data == nullptr) ? 0 : image_height; }
 
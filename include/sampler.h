@@ -0,0 +1,189 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+
+// Scrambles the bits of a 64-bit value (SplitMix64 finalizer)
+inline uint64_t mix_bits(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+// Counter based random number stream
+// The n-th number of a stream is a hash of its key and n, so a stream only depends on its key
+// and costs a handful of integer operations per draw.
+struct random_stream {
+    uint64_t key = 0;           // Identifies the stream
+    uint64_t dimension = 0;     // Number of values drawn so far
+
+    random_stream() {}
+    explicit random_stream(uint64_t key) : key(key) {}
+
+    // Returns a random real in [0, 1)
+    double next_double() {
+        uint64_t bits = mix_bits(key + ++dimension * 0x9e3779b97f4a7c15ull);
+        return static_cast<double>(bits >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // Returns a random real in [min, max)
+    double next_double(double min, double max) {
+        return min + (max-min) * next_double();
+    }
+};
+
+// Sequences the samples of a pixel draw their numbers from
+enum class sampler_type {
+    independent,    // Independent random numbers for every sample and dimension
+    sobol,          // Owen scrambled Sobol points, scrambled differently for every pixel
+    blue_noise      // One Owen scrambled Sobol sequence dealt out to the pixels in Z-order
+};
+
+inline const char* sampler_name(sampler_type type) {
+    switch (type) {
+        case sampler_type::independent: return "independent";
+        case sampler_type::sobol:       return "Owen scrambled Sobol";
+        case sampler_type::blue_noise:  return "blue noise Sobol";
+    }
+    return "unknown";
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Hash whose bit k only depends on bits 0 to k of x (Laine and Karras)
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// Owen scrambling of a 32-bit fixed point value: every bit is flipped depending on the seed and
+// the bits above it (Burley, Practical Hash-based Owen Scrambling)
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// First two dimensions of the Sobol sequence as 32-bit fixed point, bit reversed
+// Dimension 0 is the van der Corput sequence. Dimension 1 uses the direction numbers of x + 1,
+// whose generator matrix is Pascal's triangle mod 2: bit i of the result is the parity of the
+// index bits j whose positions contain every bit of i, a superset sum done in five steps.
+inline uint32_t sobol_2d_reversed(uint32_t index, int dimension) {
+    if (dimension == 1) {
+        index ^= (index >> 1) & 0x55555555u;
+        index ^= (index >> 2) & 0x33333333u;
+        index ^= (index >> 4) & 0x0f0f0f0fu;
+        index ^= (index >> 8) & 0x00ff00ffu;
+        index ^= (index >> 16) & 0x0000ffffu;
+    }
+    return index;
+}
+
+// Interleaves the bits of x and y, pixels close on screen get close codes
+inline uint32_t morton_2d(uint32_t x, uint32_t y) {
+    uint32_t code = 0;
+    for (int b = 0; b < 16; b++)
+        code |= (((x >> b) & 1) << (2 * b)) | (((y >> b) & 1) << (2 * b + 1));
+    return code;
+}
+
+// Numbers of one sample of one pixel, drawn one dimension after the other
+// The Sobol samplers pair up dimensions: each pair is a 2D Sobol point set whose order is
+// shuffled with its own scramble (padding), and each dimension's values are Owen scrambled,
+// so the points of a pixel are stratified in every dimension and every pair of dimensions.
+// The blue noise sampler takes the points of a pixel from an aligned block of one sequence,
+// indexed by the pixel's Z-order code. Neighbouring pixels then share larger aligned blocks,
+// which are stratified as a whole, so their errors cancel and what is left is high frequency
+// noise (Ahmed and Wonka, Screen-Space Blue-Noise Diffusion of Monte Carlo Sampling Error via
+// Hierarchical Ordering of Pixels). A block holds the expected sample count rounded up to a power
+// of two; samples past it start another round with a new scramble.
+//
+// The first static_dimensions dimensions of a sample can be drawn as on frame 0 whatever the
+// frame, so a renderer that caches what they lead to (the camera ray) can reuse it next frame.
+class pixel_sampler {
+  public:
+    pixel_sampler() {}
+
+    // Starts a sample of a pixel expected to take sample_count samples, key identifies the frame
+    // and pixel, static_key the pixel on frame 0
+    void start(sampler_type sequence, uint64_t key, uint64_t static_key, uint32_t frame, uint32_t x, uint32_t y,
+               uint32_t sample, uint32_t sample_count, uint32_t static_dimensions) {
+        type = sequence;
+        dimension = 0;
+        pair = kNoPair;
+        static_pairs = (static_dimensions + 1) / 2;
+        if (type == sampler_type::independent) {
+            stream_key = mix_bits(key ^ (static_cast<uint64_t>(sample) * 0xd1b54a32d192ed03ull));
+            static_stream_key = mix_bits(static_key ^ (static_cast<uint64_t>(sample) * 0xd1b54a32d192ed03ull));
+        } else if (type == sampler_type::sobol) {
+            seed = static_cast<uint32_t>(mix_bits(key));
+            static_seed = static_cast<uint32_t>(mix_bits(static_key));
+            index = sample;
+        } else {
+            int block_bits = 0;
+            while (block_bits < 16 && (1u << block_bits) < sample_count) block_bits++;
+            uint32_t round = sample >> block_bits;
+            seed = static_cast<uint32_t>(mix_bits(0x9e3779b97f4a7c15ull * (frame + 1ull) + round));
+            static_seed = static_cast<uint32_t>(mix_bits(0x9e3779b97f4a7c15ull + round));
+            index = (morton_2d(x, y) << block_bits) | (sample & ((1u << block_bits) - 1));
+        }
+    }
+
+    // Continues the sample at a fixed dimension, so a use of the numbers gets the same
+    // dimensions in every sample however many numbers were drawn before it
+    void seek(uint32_t d) {
+        dimension = d;
+    }
+
+    // Returns the next number of the sample in [0, 1)
+    double next_double() {
+        uint32_t d = dimension++;
+        bool fixed = (d >> 1) < static_pairs;
+        if (type == sampler_type::independent) {
+            random_stream stream(fixed ? static_stream_key : stream_key);
+            stream.dimension = d;
+            return stream.next_double();
+        }
+
+        // Both dimensions of a pair use the same shuffled index, drawn one after the other
+        if ((d >> 1) != pair) {
+            pair = d >> 1;
+            uint64_t h = mix_bits((static_cast<uint64_t>(fixed ? static_seed : seed) << 32) | pair);
+            shuffled = nested_uniform_scramble(index, static_cast<uint32_t>(h));
+            value_seed = static_cast<uint32_t>(h >> 32);
+        }
+
+        // nested_uniform_scramble(reverse_bits(x)) is reverse_bits(laine_karras_permutation(x))
+        uint32_t scramble = (d & 1) ? value_seed * 0x9e3779b9u + 0x7f4a7c15u : value_seed;
+        uint32_t value = reverse_bits(laine_karras_permutation(sobol_2d_reversed(shuffled, d & 1), scramble));
+        return value * (1.0 / 4294967296.0);
+    }
+
+  private:
+    sampler_type type = sampler_type::independent;
+    uint64_t stream_key = 0;    // Key of the independent numbers
+    uint64_t static_stream_key = 0;
+    uint32_t seed = 0;          // Scrambles the Sobol points
+    uint32_t static_seed = 0;   // Scrambles the Sobol points of the static dimensions
+    uint32_t static_pairs = 0;  // Pairs of dimensions drawn as on frame 0
+    uint32_t index = 0;         // Index of the sample in the Sobol sequence
+    uint32_t dimension = 0;     // Next dimension drawn
+    uint32_t pair = kNoPair;    // Pair of dimensions shuffled is for
+    uint32_t shuffled = 0;      // Index shuffled for the pair
+    uint32_t value_seed = 0;    // Scrambles the values of the pair
+
+    static const uint32_t kNoPair = 0xffffffff;
+};
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "hittable.h"
 #include "vec3.h"
+#include "material.h"
+#include "transform.h"
 #include <optional>
 
 
@@ -13,7 +15,7 @@ class sphere : public hittable {
         sphere() {}
         // Stationary
         sphere(point3 cen, double r, shared_ptr<material> m) 
-            : center1(cen), radius(r), mat_ptr(m), is_moving(false) {
+            : center1(cen), radius(r), material_id(scene_materials().add(m)), is_moving(false) {
                 // Bounding Volume requirement
                 auto rvec = vec3(radius, radius, radius);
                 bbox = aabb(center1 - rvec, center1 + rvec);
@@ -21,7 +23,7 @@ class sphere : public hittable {
 
         // Moving
         sphere(point3 cen1, point3 cen2, double r, shared_ptr<material> m)
-            : center1(cen1), radius(r), mat_ptr(m), is_moving(true)
+            : center1(cen1), radius(r), material_id(scene_materials().add(m)), is_moving(true)
             {
                 // Bounding Volume requirement
                 auto rvec = vec3(radius, radius, radius);
@@ -33,6 +35,14 @@ class sphere : public hittable {
             }
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            if (!intersect(r, ray_t, rec))
+                return false;
+            surface_interaction(r, rec);
+            return true;
+        }
+
+        // Finds the nearest root of the ray-sphere quadratic inside the interval
+        bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
 
             // Check if the ray intersects the bounding box. If not, return false.
             if (!bbox.hit(r, ray_t))
@@ -63,36 +73,25 @@ class sphere : public hittable {
                     return false;
             }
 
+            rec.t = root;
+            rec.object = this;
+            objectIsect.fetch_add(1);
+
+            return true;
+        }
+
+        // Normal, UVs and material at the hit intersect() found
+        void surface_interaction(const ray& r, hit_record& rec) const override {
+            point3 center = is_moving ? this->center(r.time()) : center1;
+
             // The outward normal at the intersection point is calculated and normalized (by dividing by the sphere's radius)
             // This outward normal is then used to set the face normal
-            rec.t = root;
             rec.p = r.at(rec.t);
             vec3 outward_normal = (rec.p - center) / radius;
             rec.set_face_normal(r, outward_normal);
 
-            // Rotate the outward_normal using rotation matrices, if there is an offset, it is accounted for
-            vec3 rotated_normal = outward_normal;
-
-            // X-axis rotation
-            rotated_normal = vec3(
-                rotated_normal.x(),
-                cos(uv_rotation_offset_x) * rotated_normal.y() - sin(uv_rotation_offset_x) * rotated_normal.z(),
-                sin(uv_rotation_offset_x) * rotated_normal.y() + cos(uv_rotation_offset_x) * rotated_normal.z()
-            );
-
-            // Y-axis rotation
-            rotated_normal = vec3(
-                cos(uv_rotation_offset_y) * rotated_normal.x() + sin(uv_rotation_offset_y) * rotated_normal.z(),
-                rotated_normal.y(),
-                -sin(uv_rotation_offset_y) * rotated_normal.x() + cos(uv_rotation_offset_y) * rotated_normal.z()
-            );
-
-            // Z-axis rotation
-            rotated_normal = vec3(
-                cos(uv_rotation_offset_z) * rotated_normal.x() - sin(uv_rotation_offset_z) * rotated_normal.y(),
-                sin(uv_rotation_offset_z) * rotated_normal.x() + cos(uv_rotation_offset_z) * rotated_normal.y(),
-                rotated_normal.z()
-            );
+            // Rotate the outward_normal by the UV rotation, if there is an offset, it is accounted for
+            vec3 rotated_normal = uv_rotation.vector(outward_normal);
 
             // Compute the UVs for the rotated normal
             get_sphere_uv(rotated_normal, rec.u, rec.v);
@@ -103,21 +102,89 @@ class sphere : public hittable {
             if (rec.v > 1.0) rec.v -= 1.0;
             if (rec.v < 0.0) rec.v += 1.0;
 
-            rec.mat_ptr = mat_ptr;
-            objectIsect.fetch_add(1);
+            rec.material_id = material_id;
+        }
+
+        // Same quadratic as hit(), either root inside the interval is enough
+        bool occluded(const ray& r, interval ray_t) const override {
+            if (!bbox.hit(r, ray_t))
+                return false;
+
+            point3 center = is_moving ? this->center(r.time()) : center1;
+            vec3 oc = r.origin() - center;
+            auto a = r.direction().length_squared();
+            auto half_b = dot(oc, r.direction());
+            auto c = oc.length_squared() - radius*radius;
 
+            auto discriminant = half_b*half_b - a*c;
+            if (discriminant < 0) return false;
+
+            auto sqrtd = sqrt(discriminant);
+            if (!ray_t.surrounds((-half_b - sqrtd) / a) && !ray_t.surrounds((-half_b + sqrtd) / a))
+                return false;
+
+            objectIsect.fetch_add(1, std::memory_order_relaxed);
             return true;
         }
 
         aabb bounding_box() const override { return bbox; }
 
+        void hash_state(state_hasher& h) const override {
+            h.add("sphere");
+            h.add(center1);
+            h.add(radius);
+            h.add(is_moving);
+            if (is_moving)
+                h.add(center_vec);
+            h.add(uv_rotation_offset_x);
+            h.add(uv_rotation_offset_y);
+            h.add(uv_rotation_offset_z);
+            scene_materials()[material_id]->hash_state(h);
+        }
+
         point3 get_center() const override {
             return center1;  
         }
 
+        // A moving sphere is not sampled: random() has no ray time to find where it is, so it is
+        // only found by the rays that hit it
+        bool is_light() const override { return !is_moving && scene_materials()[material_id]->is_emissive(); }
+
+        // Uniformly distributed direction inside the cone the sphere covers as seen from origin
+        vec3 random(const point3& origin) const override {
+            vec3 direction = center1 - origin;
+            double distance_squared = direction.length_squared();
+            if (distance_squared <= radius*radius)
+                return random_unit_vector();
+
+            // Orthonormal basis around the direction to the center
+            vec3 w = unit_vector(direction);
+            vec3 a = fabs(w.x()) > 0.9 ? vec3(0,1,0) : vec3(1,0,0);
+            vec3 v = unit_vector(cross(w, a));
+            vec3 u = cross(w, v);
+
+            double cos_theta_max = sqrt(1 - radius*radius/distance_squared);
+            double z = 1 + random_double()*(cos_theta_max - 1);
+            double phi = 2*pi*random_double();
+            double sin_theta = sqrt(fmax(0.0, 1 - z*z));
+
+            return cos(phi)*sin_theta*u + sin(phi)*sin_theta*v + z*w;
+        }
+
+        // One over the solid angle of the cone, 0 from inside the sphere
+        double light_pdf(const ray& r, const hit_record& rec) const override {
+            double distance_squared = (center1 - r.origin()).length_squared();
+            if (distance_squared <= radius*radius)
+                return 0.0;
+
+            double cos_theta_max = sqrt(1 - radius*radius/distance_squared);
+            return 1 / (2*pi*(1 - cos_theta_max));
+        }
+
         void translate(const point3& offset) {
             center1 += offset;
             bbox = bbox + offset;
+            revision_count++;
         }
 
         void rotate(std::string axis, double degrees) {
@@ -129,6 +196,12 @@ class sphere : public hittable {
             } else if (axis == "z") {
                 uv_rotation_offset_z += radians;
             }
+
+            // Rotations about X, then Y, then Z, composed once here instead of on every hit
+            uv_rotation = transform::rotation(vec3(0, 0, 1), uv_rotation_offset_z * 180.0 / pi) *
+                          transform::rotation(vec3(0, 1, 0), uv_rotation_offset_y * 180.0 / pi) *
+                          transform::rotation(vec3(1, 0, 0), uv_rotation_offset_x * 180.0 / pi);
+            revision_count++;
             
         }
 
@@ -136,7 +209,7 @@ class sphere : public hittable {
     private:
         point3 center1;
         double radius;
-        shared_ptr<material> mat_ptr;
+        uint32_t material_id;
         bool is_moving;
         vec3 center_vec;
         aabb bbox;
@@ -144,6 +217,7 @@ class sphere : public hittable {
         double uv_rotation_offset_x = 0.0;
         double uv_rotation_offset_y = 0.0;
         double uv_rotation_offset_z = 0.0;
+        transform uv_rotation;      // Turns outward normals into the rotated frame the UVs are taken in
 
 
         point3 center(double time) const {
@@ -0,0 +1,63 @@
+#ifndef STATE_HASH_H
+#define STATE_HASH_H
+
+#include "main.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Order dependent 64-bit hash of the values that describe a scene
+// Only values go in, never addresses, so the same scene built again by another run of the
+// program hashes the same. Doubles are hashed by their bits with -0 folded into 0.
+class state_hasher {
+  public:
+    void add(uint64_t x) {
+        state = mix_bits(state ^ (x + 0x9e3779b97f4a7c15ull + (state << 6) + (state >> 2)));
+    }
+
+    void add(uint32_t x) { add(static_cast<uint64_t>(x)); }
+
+    void add(int x) { add(static_cast<uint64_t>(static_cast<int64_t>(x))); }
+
+    void add(bool x) { add(static_cast<uint64_t>(x)); }
+
+    void add(double x) {
+        if (x == 0.0) x = 0.0;
+        uint64_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        add(bits);
+    }
+
+    // Names the kind of object that comes next, so different kinds with the same numbers differ
+    void add(const char* tag) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (const char* c = tag; *c != '\0'; c++)
+            h = (h ^ static_cast<unsigned char>(*c)) * 0x100000001b3ull;
+        add(h);
+    }
+
+    void add(const std::string& text) { add(text.c_str()); }
+
+    void add(const vec3& v) {
+        add(v.x());
+        add(v.y());
+        add(v.z());
+    }
+
+    void add_bytes(const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < size; i++)
+            h = (h ^ bytes[i]) * 0x100000001b3ull;
+        add(h);
+        add(static_cast<uint64_t>(size));
+    }
+
+    uint64_t value() const { return state; }
+
+  private:
+    uint64_t state = 0;
+};
+
+#endif
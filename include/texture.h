@@ -4,6 +4,7 @@
 #include "main.h"
 #include "rtw_stb_image.h"
 #include "perlin.h"
+#include "state_hash.h"
 
 
 
@@ -12,6 +13,9 @@ class texture {
     virtual ~texture() = default;
 
     virtual color value(double u, double v, const point3& p) const = 0;
+
+    // Adds everything value() depends on to a scene hash
+    virtual void hash_state(state_hasher& h) const = 0;
 };
 
 class solid_color : public texture {
@@ -24,6 +28,11 @@ class solid_color : public texture {
         return color_value;
     }
 
+    void hash_state(state_hasher& h) const override {
+        h.add("solid_color");
+        h.add(color_value);
+    }
+
   private:
     color color_value;
 };
@@ -49,6 +58,13 @@ class checker_texture : public texture {
         return isEven ? even->value(u, v, p) : odd->value(u, v, p);
     }
 
+    void hash_state(state_hasher& h) const override {
+        h.add("checker_texture");
+        h.add(inv_scale);
+        even->hash_state(h);
+        odd->hash_state(h);
+    }
+
   private:
     double inv_scale;
     shared_ptr<texture> even;
@@ -75,8 +91,21 @@ class image_texture : public texture {
         return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
     }
 
+    // The pixels are hashed once, they do not change after loading
+    void hash_state(state_hasher& h) const override {
+        h.add("image_texture");
+        h.add(pixels_hash);
+    }
+
   private:
     rtw_image image;
+    uint64_t pixels_hash = hash_image(image);
+
+    static uint64_t hash_image(const rtw_image& image) {
+        state_hasher h;
+        image.hash_state(h);
+        return h.value();
+    }
 };
 
 class noise_texture : public texture {
@@ -92,9 +121,15 @@ class noise_texture : public texture {
         return color(1,1,1) * 0.5 * (1 + sin(s.z() + 10*noise.turb(s)));
     }
 
+    void hash_state(state_hasher& h) const override {
+        h.add("noise_texture");
+        h.add(scale);
+        noise.hash_state(h);
+    }
+
   private:
     perlin noise;
-	double scale;
+	double scale = 1.0;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,142 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "main.h"
+#include "aabb.h"
+
+// Affine transformation stored as a 3x4 matrix
+// The left 3x3 block is the linear part (rotation, scale, shear) and the last column the
+// translation, so a point p maps to m * p + t and a vector v to m * v.
+class transform {
+  public:
+    double m[3][4];
+
+    // Identity transform
+    transform() {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                m[i][j] = (i == j) ? 1.0 : 0.0;
+    }
+
+    // Moves points by an offset
+    static transform translation(const vec3& offset) {
+        transform t;
+        t.m[0][3] = offset.x();
+        t.m[1][3] = offset.y();
+        t.m[2][3] = offset.z();
+        return t;
+    }
+
+    // Scales each axis independently
+    static transform scaling(const vec3& factors) {
+        transform t;
+        t.m[0][0] = factors.x();
+        t.m[1][1] = factors.y();
+        t.m[2][2] = factors.z();
+        return t;
+    }
+
+    // Rotates around an axis through the origin (Rodrigues' formula)
+    static transform rotation(const vec3& axis, double degrees) {
+        vec3 a = unit_vector(axis);
+        double radians = degrees_to_radians(degrees);
+        double c = cos(radians);
+        double s = sin(radians);
+        double k = 1 - c;
+
+        transform t;
+        t.m[0][0] = c + a.x()*a.x()*k;
+        t.m[0][1] = a.x()*a.y()*k - a.z()*s;
+        t.m[0][2] = a.x()*a.z()*k + a.y()*s;
+        t.m[1][0] = a.y()*a.x()*k + a.z()*s;
+        t.m[1][1] = c + a.y()*a.y()*k;
+        t.m[1][2] = a.y()*a.z()*k - a.x()*s;
+        t.m[2][0] = a.z()*a.x()*k - a.y()*s;
+        t.m[2][1] = a.z()*a.y()*k + a.x()*s;
+        t.m[2][2] = c + a.z()*a.z()*k;
+        return t;
+    }
+
+    // Applies the transform to a point
+    point3 point(const point3& p) const {
+        return point3(
+            m[0][0]*p.x() + m[0][1]*p.y() + m[0][2]*p.z() + m[0][3],
+            m[1][0]*p.x() + m[1][1]*p.y() + m[1][2]*p.z() + m[1][3],
+            m[2][0]*p.x() + m[2][1]*p.y() + m[2][2]*p.z() + m[2][3]
+        );
+    }
+
+    // Applies the linear part of the transform to a direction
+    vec3 vector(const vec3& v) const {
+        return vec3(
+            m[0][0]*v.x() + m[0][1]*v.y() + m[0][2]*v.z(),
+            m[1][0]*v.x() + m[1][1]*v.y() + m[1][2]*v.z(),
+            m[2][0]*v.x() + m[2][1]*v.y() + m[2][2]*v.z()
+        );
+    }
+
+    // Applies the transpose of the linear part, called on the inverse transform this maps normals
+    vec3 transposed_vector(const vec3& v) const {
+        return vec3(
+            m[0][0]*v.x() + m[1][0]*v.y() + m[2][0]*v.z(),
+            m[0][1]*v.x() + m[1][1]*v.y() + m[2][1]*v.z(),
+            m[0][2]*v.x() + m[1][2]*v.y() + m[2][2]*v.z()
+        );
+    }
+
+    // Box around the transformed corners of a box
+    // Each output axis takes the smaller/larger product per input axis (Arvo's method) instead of
+    // transforming all eight corners.
+    aabb box(const aabb& b) const {
+        double lo[3], hi[3];
+        for (int i = 0; i < 3; i++) {
+            lo[i] = hi[i] = m[i][3];
+            for (int j = 0; j < 3; j++) {
+                double e = m[i][j] * b.axis(j).min;
+                double f = m[i][j] * b.axis(j).max;
+                lo[i] += fmin(e, f);
+                hi[i] += fmax(e, f);
+            }
+        }
+        return aabb(interval(lo[0], hi[0]), interval(lo[1], hi[1]), interval(lo[2], hi[2]));
+    }
+
+    // Inverse transform, the linear part is inverted through its adjugate
+    transform inverse() const {
+        double det = m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1])
+                   - m[0][1] * (m[1][0]*m[2][2] - m[1][2]*m[2][0])
+                   + m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+        double inv_det = 1.0 / det;
+
+        transform r;
+        r.m[0][0] =  (m[1][1]*m[2][2] - m[1][2]*m[2][1]) * inv_det;
+        r.m[0][1] = -(m[0][1]*m[2][2] - m[0][2]*m[2][1]) * inv_det;
+        r.m[0][2] =  (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+        r.m[1][0] = -(m[1][0]*m[2][2] - m[1][2]*m[2][0]) * inv_det;
+        r.m[1][1] =  (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+        r.m[1][2] = -(m[0][0]*m[1][2] - m[0][2]*m[1][0]) * inv_det;
+        r.m[2][0] =  (m[1][0]*m[2][1] - m[1][1]*m[2][0]) * inv_det;
+        r.m[2][1] = -(m[0][0]*m[2][1] - m[0][1]*m[2][0]) * inv_det;
+        r.m[2][2] =  (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+
+        // The inverse translation undoes the original one after the inverse linear part
+        for (int i = 0; i < 3; i++)
+            r.m[i][3] = -(r.m[i][0]*m[0][3] + r.m[i][1]*m[1][3] + r.m[i][2]*m[2][3]);
+
+        return r;
+    }
+};
+
+// Composes two transforms, the result applies b first and then a
+inline transform operator*(const transform& a, const transform& b) {
+    transform r;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            r.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] + a.m[i][2]*b.m[2][j];
+        }
+        r.m[i][3] += a.m[i][3];
+    }
+    return r;
+}
+
+#endif
@@ -13,8 +13,10 @@ class triangle : public hittable {
     public: 
         triangle() {}
         triangle(point3 _v0, point3 _v1, point3 _v2, shared_ptr<material> m, bool singleSided = false) 
-            : v0(_v0), v1(_v1), v2(_v2), mat_ptr(m), singleSided(singleSided) {
-                normal = unit_vector(cross(v1 - v0, v2 - v0));
+            : v0(_v0), v1(_v1), v2(_v2), material_id(scene_materials().add(m)), singleSided(singleSided) {
+                edge1 = v1 - v0;
+                edge2 = v2 - v0;
+                normal = unit_vector(cross(edge1, edge2));
 
                 // Bounding Volume requirement'
                 // Find minimum and maximum x, y, and z coordinates from the triangle's vertices
@@ -43,25 +45,22 @@ class triangle : public hittable {
 
             
 
-        // Function for ray triangle intersections
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            if (!intersect(r, ray_t, rec))
+                return false;
+            surface_interaction(r, rec);
+            return true;
+        }
 
-        
-
-
-
-            //Check if the ray intersects the bounding box. If not, return false.
-            if (!bbox.hit(r, ray_t))
-              return false;
-
-            extern std::atomic<uint64_t> numRayTrianglesTests;
-            numRayTrianglesTests.fetch_add(1);
+        // Function for ray triangle intersections
+        // The barycentric coordinates are kept in locals and only written out with t once the hit
+        // is known to be inside the interval.
+        bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+            numRayTrianglesTests.fetch_add(1, std::memory_order_relaxed);
 
-            // Edge vector computation
-            // Edge 1
-            vec3 v0v1 = v1 - v0;
-            // Edge 2
-            vec3 v0v2 = v2 - v0;
+            // Edges are computed once in the constructor
+            const vec3& v0v1 = edge1;
+            const vec3& v0v2 = edge2;
 
             // Compute the cross product fo ray direction and edge 2
             vec3 pvec = cross(r.direction(), v0v2);
@@ -78,44 +77,100 @@ class triangle : public hittable {
             // Calculate inverse of the determinant
             float invDet = 1.0 / det;
             vec3 tvec = r.origin() - v0;
-            rec.u = dot(tvec, pvec) * invDet;
+            double u = dot(tvec, pvec) * invDet;
 
             // Check if the intersection is outside of the triangle
-            if (rec.u < 0.0 || rec.u > 1.0)
+            if (u < 0.0 || u > 1.0)
                 return false;
 
             // Compute cross product of vector from vertex to ray origin and edge1
             vec3 qvec = cross(tvec, v0v1);
-            rec.v = dot(r.direction(), qvec) * invDet;
+            double v = dot(r.direction(), qvec) * invDet;
 
             // Check if the intersection is outside of the triangle
-            if (rec.v < 0 || rec.u + rec.v > 1) return false;
+            if (v < 0 || u + v > 1) return false;
 
             // Compute where the interesection point is along the ray
-            rec.t = dot(v0v2, qvec) * invDet;
+            double t = dot(v0v2, qvec) * invDet;
 
             // Check if t is within the valid range:
-            if (rec.t <= ray_t.min || rec.t >= ray_t.max || rec.t <= kEpsilon) return false;
+            if (t <= ray_t.min || t >= ray_t.max || t <= kEpsilon) return false;
 
 
             // If t is positive, there was an intersection
+            rec.t = t;
+            rec.u = u;
+            rec.v = v;
+            rec.object = this;
+
+            numRayTrianglesIsect.fetch_add(1, std::memory_order_relaxed);
+            objectIsect.fetch_add(1, std::memory_order_relaxed);
+
+            return true;
+        }
+
+        void surface_interaction(const ray& r, hit_record& rec) const override {
             rec.p = r.at(rec.t);
             rec.normal = normal;
-            rec.mat_ptr = mat_ptr;
+            rec.material_id = material_id;
+        }
 
-            extern std::atomic<uint64_t> numRayTrianglesIsect;
-            numRayTrianglesIsect.fetch_add(1);
-            objectIsect.fetch_add(1);
+        // The same test as hit(), without writing a hit record
+        bool occluded(const ray& r, interval ray_t) const override {
+            numRayTrianglesTests.fetch_add(1, std::memory_order_relaxed);
 
+            vec3 pvec = cross(r.direction(), edge2);
+            float det = dot(edge1, pvec);
+
+            if (singleSided && det < kEpsilon) return false;
+            if (det < kEpsilon && det > -kEpsilon) return false;
+
+            float invDet = 1.0 / det;
+            vec3 tvec = r.origin() - v0;
+            double u = dot(tvec, pvec) * invDet;
+            if (u < 0.0 || u > 1.0)
+                return false;
+
+            vec3 qvec = cross(tvec, edge1);
+            double v = dot(r.direction(), qvec) * invDet;
+            if (v < 0 || u + v > 1) return false;
+
+            double t = dot(edge2, qvec) * invDet;
+            if (t <= ray_t.min || t >= ray_t.max || t <= kEpsilon) return false;
+
+            numRayTrianglesIsect.fetch_add(1, std::memory_order_relaxed);
+            objectIsect.fetch_add(1, std::memory_order_relaxed);
             return true;
         }
 
         aabb bounding_box() const override { return bbox; }
 
+        void hash_state(state_hasher& h) const override {
+            h.add("triangle");
+            h.add(v0);
+            h.add(v1);
+            h.add(v2);
+            h.add(singleSided);
+            scene_materials()[material_id]->hash_state(h);
+        }
+
+        // Distance and barycentric coordinates of the crossing of a ray with the triangle's plane
+        // Used to redo a hit found in single precision (triangle_block) in double precision.
+        void barycentric(const ray& r, double& t, double& u, double& v) const {
+            vec3 pvec = cross(r.direction(), edge2);
+            double inv_det = 1.0 / dot(edge1, pvec);
+            vec3 tvec = r.origin() - v0;
+            vec3 qvec = cross(tvec, edge1);
+            u = dot(tvec, pvec) * inv_det;
+            v = dot(r.direction(), qvec) * inv_det;
+            t = dot(edge2, qvec) * inv_det;
+        }
+
     
     public:
         point3 v0, v1, v2;
-        shared_ptr<material> mat_ptr;
+        vec3 edge1, edge2;          // v1 - v0 and v2 - v0
+        uint32_t material_id;
         vec3 normal;
         bool singleSided;
         aabb bbox;
@@ -0,0 +1,191 @@
+#ifndef TRIANGLE_BLOCK_H
+#define TRIANGLE_BLOCK_H
+
+#include "main.h"
+#include "wide_bvh.h"
+
+#include <cstdint>
+
+// Up to N triangles stored as structure of arrays, one lane per triangle
+// Holds what Moller-Trumbore needs (first vertex and the two edges leaving it), so one ray is
+// tested against all of them with a few vector instructions and no per-test edge subtraction.
+template <int N>
+struct triangle_block {
+    float v0[3][N];     // First vertex
+    float e1[3][N];     // v1 - v0
+    float e2[3][N];     // v2 - v0
+
+    // Stores a triangle in a lane
+    void set(int lane, const point3& a, const point3& b, const point3& c) {
+        for (int k = 0; k < 3; k++) {
+            v0[k][lane] = static_cast<float>(a[k]);
+            e1[k][lane] = static_cast<float>(b[k] - a[k]);
+            e2[k][lane] = static_cast<float>(c[k] - a[k]);
+        }
+    }
+
+    // Fills a lane with a degenerate triangle, which no ray can hit
+    void clear(int lane) {
+        for (int k = 0; k < 3; k++)
+            v0[k][lane] = e1[k][lane] = e2[k][lane] = 0.0f;
+    }
+};
+
+// Ray data shared by every block test
+struct triangle_block_ray {
+    float origin[3];
+    float dir[3];
+
+    triangle_block_ray(const ray& r) {
+        for (int k = 0; k < 3; k++) {
+            origin[k] = static_cast<float>(r.origin()[k]);
+            dir[k] = static_cast<float>(r.direction()[k]);
+        }
+    }
+};
+
+// Portable Moller-Trumbore test of every lane of a block
+// Returns a bit mask of the lanes hit within (tmin, tmax) and writes their distances to t.
+template <int N>
+inline unsigned intersect_triangles_scalar(const triangle_block<N>& b, const triangle_block_ray& r,
+                                           float tmin, float tmax, float* t) {
+    unsigned mask = 0;
+    for (int i = 0; i < N; i++) {
+        float px = r.dir[1] * b.e2[2][i] - r.dir[2] * b.e2[1][i];
+        float py = r.dir[2] * b.e2[0][i] - r.dir[0] * b.e2[2][i];
+        float pz = r.dir[0] * b.e2[1][i] - r.dir[1] * b.e2[0][i];
+        float det = b.e1[0][i] * px + b.e1[1][i] * py + b.e1[2][i] * pz;
+        if (det < kEpsilon && det > -kEpsilon) continue;
+
+        float inv_det = 1.0f / det;
+        float tx = r.origin[0] - b.v0[0][i];
+        float ty = r.origin[1] - b.v0[1][i];
+        float tz = r.origin[2] - b.v0[2][i];
+        float u = (tx * px + ty * py + tz * pz) * inv_det;
+        if (u < 0.0f || u > 1.0f) continue;
+
+        float qx = ty * b.e1[2][i] - tz * b.e1[1][i];
+        float qy = tz * b.e1[0][i] - tx * b.e1[2][i];
+        float qz = tx * b.e1[1][i] - ty * b.e1[0][i];
+        float v = (r.dir[0] * qx + r.dir[1] * qy + r.dir[2] * qz) * inv_det;
+        if (v < 0.0f || u + v > 1.0f) continue;
+
+        t[i] = (b.e2[0][i] * qx + b.e2[1][i] * qy + b.e2[2][i] * qz) * inv_det;
+        if (t[i] > tmin && t[i] < tmax)
+            mask |= 1u << i;
+    }
+    return mask;
+}
+
+#ifdef RT_X86_SIMD
+
+// SSE Moller-Trumbore test of a block of four triangles
+__attribute__((target("sse2")))
+inline unsigned intersect_triangles_sse(const triangle_block<4>& b, const triangle_block_ray& r,
+                                        float tmin, float tmax, float* t) {
+    const __m128 dx = _mm_set1_ps(r.dir[0]), dy = _mm_set1_ps(r.dir[1]), dz = _mm_set1_ps(r.dir[2]);
+    const __m128 e1x = _mm_loadu_ps(b.e1[0]), e1y = _mm_loadu_ps(b.e1[1]), e1z = _mm_loadu_ps(b.e1[2]);
+    const __m128 e2x = _mm_loadu_ps(b.e2[0]), e2y = _mm_loadu_ps(b.e2[1]), e2z = _mm_loadu_ps(b.e2[2]);
+
+    // pvec = dir x e2, det = e1 . pvec
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    // tvec = origin - v0, u = tvec . pvec / det
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(r.origin[0]), _mm_loadu_ps(b.v0[0]));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(r.origin[1]), _mm_loadu_ps(b.v0[1]));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(r.origin[2]), _mm_loadu_ps(b.v0[2]));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+
+    // qvec = tvec x e1, v = dir . qvec / det, t = e2 . qvec / det
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+    __m128 dist = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+    // |det| >= epsilon, u in [0, 1], v >= 0, u + v <= 1, t in (tmin, tmax)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 valid = _mm_cmpge_ps(_mm_and_ps(det, abs_mask), _mm_set1_ps(kEpsilon));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(u, one));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(dist, _mm_set1_ps(tmin)));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(dist, _mm_set1_ps(tmax)));
+
+    _mm_storeu_ps(t, dist);
+    return static_cast<unsigned>(_mm_movemask_ps(valid));
+}
+
+// AVX2 Moller-Trumbore test of a block of eight triangles
+__attribute__((target("avx2")))
+inline unsigned intersect_triangles_avx2(const triangle_block<8>& b, const triangle_block_ray& r,
+                                         float tmin, float tmax, float* t) {
+    const __m256 dx = _mm256_set1_ps(r.dir[0]), dy = _mm256_set1_ps(r.dir[1]), dz = _mm256_set1_ps(r.dir[2]);
+    const __m256 e1x = _mm256_loadu_ps(b.e1[0]), e1y = _mm256_loadu_ps(b.e1[1]), e1z = _mm256_loadu_ps(b.e1[2]);
+    const __m256 e2x = _mm256_loadu_ps(b.e2[0]), e2y = _mm256_loadu_ps(b.e2[1]), e2z = _mm256_loadu_ps(b.e2[2]);
+
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+    __m256 tx = _mm256_sub_ps(_mm256_set1_ps(r.origin[0]), _mm256_loadu_ps(b.v0[0]));
+    __m256 ty = _mm256_sub_ps(_mm256_set1_ps(r.origin[1]), _mm256_loadu_ps(b.v0[1]));
+    __m256 tz = _mm256_sub_ps(_mm256_set1_ps(r.origin[2]), _mm256_loadu_ps(b.v0[2]));
+    __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv_det);
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+    __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det);
+    __m256 dist = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv_det);
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 valid = _mm256_cmp_ps(_mm256_and_ps(det, abs_mask), _mm256_set1_ps(kEpsilon), _CMP_GE_OQ);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(dist, _mm256_set1_ps(tmin), _CMP_GT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(dist, _mm256_set1_ps(tmax), _CMP_LT_OQ));
+
+    _mm256_storeu_ps(t, dist);
+    return static_cast<unsigned>(_mm256_movemask_ps(valid));
+}
+
+#endif
+
+inline unsigned intersect_triangles(const triangle_block<4>& b, const triangle_block_ray& r,
+                                    float tmin, float tmax, float* t) {
+#ifdef RT_X86_SIMD
+    return intersect_triangles_sse(b, r, tmin, tmax, t);
+#else
+    return intersect_triangles_scalar<4>(b, r, tmin, tmax, t);
+#endif
+}
+
+inline unsigned intersect_triangles(const triangle_block<8>& b, const triangle_block_ray& r,
+                                    float tmin, float tmax, float* t) {
+#ifdef RT_X86_SIMD
+    return intersect_triangles_avx2(b, r, tmin, tmax, t);
+#else
+    return intersect_triangles_scalar<8>(b, r, tmin, tmax, t);
+#endif
+}
+
+// Triangles per block on this machine, 8 with AVX2 and 4 otherwise
+inline int triangle_block_width() {
+    return wide_bvh_width() == 8 ? 8 : 4;
+}
+
+#endif
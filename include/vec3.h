@@ -120,16 +120,21 @@ inline vec3 unit_vector(vec3 v) {
     return v / v.length();
 }
 
-vec3 random_in_unit_sphere() {
-    while (true) {
-        auto p = vec3::random(-1, 1);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
-}
+// The samplers below warp a fixed number of random numbers straight to the shape instead of
+// rejecting points outside of it, so every call draws the same dimensions of a sample
 
+// Uniform direction, z uniform in [-1, 1] and the angle around z uniform
 vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+    auto z = 1 - 2*random_double();
+    auto r = sqrt(fmax(0.0, 1 - z*z));
+    auto phi = 2*pi*random_double();
+    return vec3(r*cos(phi), r*sin(phi), z);
+}
+
+// Uniform point in the unit ball, a uniform direction scaled by the cube root of a uniform number
+vec3 random_in_unit_sphere() {
+    vec3 direction = random_unit_vector();
+    return cbrt(random_double()) * direction;
 }
 
 vec3 random_in_hemisphere(const vec3& normal) {
@@ -151,12 +156,23 @@ vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
     return r_out_perp + r_out_parallel;
 }
 
+// Uniform point in the unit disk, concentric map of the square onto the disk (Shirley and Chiu),
+// which keeps neighbouring points of the square close on the disk
 vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() >= 1) continue;
-        return p;
+    auto a = random_double(-1, 1);
+    auto b = random_double(-1, 1);
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+
+    double r, phi;
+    if (fabs(a) > fabs(b)) {
+        r = a;
+        phi = (pi/4) * (b/a);
+    } else {
+        r = b;
+        phi = (pi/2) - (pi/4) * (a/b);
     }
+    return vec3(r*cos(phi), r*sin(phi), 0);
 }
 
 #endif
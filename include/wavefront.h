@@ -0,0 +1,478 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "main.h"
+#include "camera.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// Path integrator that traces a batch of paths stage by stage instead of one path at a time
+// Every bounce runs five stages over the paths still alive: intersect finds the closest hit of
+// every path (and ends the ones that miss), sort orders the hits by material, shade runs the
+// materials and picks the light samples in that order, shadow traces the rays towards the
+// light samples, and compact moves the surviving paths to the front of the queue, keeping their
+// order. The paths and their hits are kept field by field in contiguous arrays, so each stage
+// streams through the fields it needs and runs one material's code over many hits in a row.
+//
+// Camera rays and shadow rays are traced in packets of packet_rays consecutive rays, which
+// share their way through the scene's hierarchy, see hittable::hit_packet(). Paths are added
+// a block of pixels at a time, so consecutive camera rays are those of neighbouring pixels.
+// Scattered rays go every which way and are traced one by one.
+//
+// Each stage starts a path's sample again and seeks the dimensions camera::ray_color would use
+// for the bounce, so a path draws the same numbers as it would depth first and both integrators
+// give the same result.
+class wavefront_integrator {
+  public:
+    // How the paths draw their random numbers, as passed to start_sample()
+    sampler_type sampler = sampler_type::sobol;
+    uint32_t frame = 0;
+    uint32_t sample_count = 1;          // Samples the paths' pixels are expected to take
+    uint32_t static_dimensions = 0;
+
+    int packet_rays = kMaxPacketRays;   // Camera and shadow rays traced as one packet, 1 traces every ray alone
+
+    // Forgets the paths added so far
+    void clear() {
+        path_x.clear();
+        path_y.clear();
+        path_sample.clear();
+        path_radiance.clear();
+        path_features.clear();
+        queue.clear();
+    }
+
+    // Adds the path of sample `sample` of the pixel in column x of row y, whose camera ray is r
+    // If first is set the camera ray is tested against it alone, see camera::ray_color.
+    void add(const ray& r, const hittable* first, uint32_t x, uint32_t y, uint32_t sample) {
+        uint32_t id = static_cast<uint32_t>(path_x.size());
+        path_x.push_back(x);
+        path_y.push_back(y);
+        path_sample.push_back(sample);
+        path_radiance.push_back(color(0,0,0));
+        path_features.push_back(surface_features());
+        queue.push(id, r, first);
+    }
+
+    // Number of paths added
+    size_t size() const { return path_x.size(); }
+
+    // Pixel of the i-th path added
+    uint32_t x(size_t i) const { return path_x[i]; }
+    uint32_t y(size_t i) const { return path_y[i]; }
+
+    // Light the i-th path added carried back, valid after trace()
+    const color& radiance(size_t i) const { return path_radiance[i]; }
+
+    // Albedo and normal the i-th path added saw first, valid after trace() with features set
+    const surface_features& features(size_t i) const { return path_features[i]; }
+
+    // Camera rays traced through the scene, and the time spent tracing them, over all calls to
+    // trace(); the ones the primary cache answers are not counted
+    uint64_t primary_rays() const { return primary_count; }
+    double primary_seconds() const { return primary_time; }
+
+    // Scattered and shadow rays traced, and the time spent tracing them
+    uint64_t secondary_rays() const { return secondary_count; }
+    double secondary_seconds() const { return secondary_time; }
+
+    // Shadow rays traced, counted in secondary_rays() as well
+    uint64_t shadow_rays() const { return shadow_count; }
+
+    // Camera and shadow rays that were traced in packets of more than one ray
+    uint64_t packet_rays_traced() const { return packet_ray_count; }
+
+    // Traces every path added since clear()
+    // The primitives the paths are tested against during the first cam.record_depth bounces, or
+    // all of them when it is 0, are added to record, unless it is nullptr.
+    void trace(const camera& cam, const hittable& world, const std::vector<const hittable*>& lights, int max_depth,
+               bool features, uint64_t* record) {
+        uint64_t segments = 0;
+
+        for (int bounce = 0; bounce < max_depth && queue.size() > 0; bounce++) {
+            uint32_t dimension = camera::kCameraDimensions + bounce * camera::kBounceDimensions;
+            primitive_recorder() = cam.record_depth <= 0 || bounce < cam.record_depth ? record : nullptr;
+            segments += queue.size();
+
+            intersect(cam, world, bounce, dimension, features);
+
+            sort_by_material();
+            shade(cam, lights, bounce, dimension, features);
+
+            auto shadow_start = std::chrono::steady_clock::now();
+            trace_shadows(world);
+            secondary_count += shadows.path.size();
+            shadow_count += shadows.path.size();
+            secondary_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - shadow_start).count();
+
+            queue.compact(alive);
+        }
+
+        primitive_recorder() = nullptr;
+        numPathSegments.fetch_add(segments, std::memory_order_relaxed);
+    }
+
+  private:
+    // Paths still being traced, one entry per path
+    struct path_queue {
+        std::vector<uint32_t> id;               // Which path added the entry is
+        std::vector<point3> origin;             // Ray of the current bounce
+        std::vector<vec3> direction;
+        std::vector<double> time;
+        std::vector<color> throughput;          // Product of the attenuations so far
+        std::vector<double> scatter_pdf;        // Density the previous bounce picked the ray with, 0 for none
+        std::vector<const hittable*> first;     // Object the camera ray is tested against alone, or nullptr
+        std::vector<uint8_t> features_found;    // Whether the features are final
+
+        size_t size() const { return id.size(); }
+
+        void clear() {
+            id.clear();
+            origin.clear();
+            direction.clear();
+            time.clear();
+            throughput.clear();
+            scatter_pdf.clear();
+            first.clear();
+            features_found.clear();
+        }
+
+        void push(uint32_t path, const ray& r, const hittable* first_object) {
+            id.push_back(path);
+            origin.push_back(r.origin());
+            direction.push_back(r.direction());
+            time.push_back(r.time());
+            throughput.push_back(color(1,1,1));
+            scatter_pdf.push_back(0.0);
+            first.push_back(first_object);
+            features_found.push_back(0);
+        }
+
+        ray path_ray(size_t i) const { return ray(origin[i], direction[i], time[i]); }
+
+        // Moves the entries whose keep flag is set to the front, in order, and drops the rest
+        void compact(const std::vector<uint8_t>& keep) {
+            size_t n = 0;
+            for (size_t i = 0; i < size(); i++) {
+                if (!keep[i]) continue;
+                id[n] = id[i];
+                origin[n] = origin[i];
+                direction[n] = direction[i];
+                time[n] = time[i];
+                throughput[n] = throughput[i];
+                scatter_pdf[n] = scatter_pdf[i];
+                first[n] = first[i];
+                features_found[n] = features_found[i];
+                n++;
+            }
+            id.resize(n);
+            origin.resize(n);
+            direction.resize(n);
+            time.resize(n);
+            throughput.resize(n);
+            scatter_pdf.resize(n);
+            first.resize(n);
+            features_found.resize(n);
+        }
+    };
+
+    // Closest hit of every queue entry, written by the intersect stage
+    struct hit_queue {
+        std::vector<point3> p;
+        std::vector<vec3> normal;
+        std::vector<double> t;
+        std::vector<double> u;
+        std::vector<double> v;
+        std::vector<const hittable*> object;
+        std::vector<uint32_t> material_id;
+        std::vector<uint32_t> primitive;
+        std::vector<uint32_t> element;
+        std::vector<uint8_t> front_face;
+
+        void resize(size_t n) {
+            p.resize(n);
+            normal.resize(n);
+            t.resize(n);
+            u.resize(n);
+            v.resize(n);
+            object.resize(n);
+            material_id.resize(n);
+            primitive.resize(n);
+            element.resize(n);
+            front_face.resize(n);
+        }
+
+        void store(size_t i, const hit_record& rec) {
+            p[i] = rec.p;
+            normal[i] = rec.normal;
+            t[i] = rec.t;
+            u[i] = rec.u;
+            v[i] = rec.v;
+            object[i] = rec.object;
+            material_id[i] = rec.material_id;
+            primitive[i] = rec.primitive;
+            element[i] = rec.element;
+            front_face[i] = rec.front_face;
+        }
+
+        hit_record record(size_t i) const {
+            hit_record rec;
+            rec.p = p[i];
+            rec.normal = normal[i];
+            rec.t = t[i];
+            rec.u = u[i];
+            rec.v = v[i];
+            rec.object = object[i];
+            rec.material_id = material_id[i];
+            rec.primitive = primitive[i];
+            rec.element = element[i];
+            rec.front_face = front_face[i] != 0;
+            return rec;
+        }
+    };
+
+    // Shadow rays of the light samples shade picked, traced by the shadow stage
+    struct shadow_queue {
+        std::vector<uint32_t> path;             // Path added the light sample belongs to
+        std::vector<ray> shadow;
+        std::vector<interval> shadow_t;         // Part of the ray in front of the light
+        std::vector<color> light;               // What the sample adds to the path unless blocked
+        std::vector<pixel_sampler> sequence;    // Random sequence of the path, at the shadow ray's dimensions
+
+        void clear() {
+            path.clear();
+            shadow.clear();
+            shadow_t.clear();
+            light.clear();
+            sequence.clear();
+        }
+    };
+
+    std::vector<uint32_t> path_x;               // Per path added: pixel, sample and result
+    std::vector<uint32_t> path_y;
+    std::vector<uint32_t> path_sample;
+    std::vector<color> path_radiance;
+    std::vector<surface_features> path_features;
+
+    path_queue queue;
+    hit_queue hits;
+    shadow_queue shadows;
+    std::vector<uint8_t> alive;                 // Whether each queue entry goes on to the next bounce
+    std::vector<uint32_t> order;                // Queue entries that hit something, by material
+    std::vector<uint32_t> bucket_start;         // Start of each material's run in order
+
+    uint64_t primary_count = 0;
+    double primary_time = 0.0;
+    uint64_t secondary_count = 0;
+    double secondary_time = 0.0;
+    uint64_t shadow_count = 0;
+    uint64_t packet_ray_count = 0;
+
+    // Continues the sample of queue entry i at dimension d
+    void resume(size_t i, uint32_t d) const {
+        uint32_t path = queue.id[i];
+        start_sample(sampler, frame, path_x[path], path_y[path], path_sample[path], sample_count, static_dimensions);
+        seek_sample_dimension(d);
+    }
+
+    // Finds the closest hit of every path, paths that miss take the background and end
+    // Camera rays that are tested against the whole scene go in packets. Camera rays whose
+    // first object is known only test that object, so they are left out of the primary ray
+    // counts and times, which measure tracing through the scene.
+    void intersect(const camera& cam, const hittable& world, int bounce, uint32_t dimension, bool features) {
+        size_t n = queue.size();
+        hits.resize(n);
+        alive.assign(n, 0);
+
+        if (bounce == 0) {
+            for (size_t i = 0; i < n; i++) {
+                if (queue.first[i] == nullptr) continue;
+                resume(i, dimension);
+                hit_record rec;
+                bool found = queue.first[i]->hit(queue.path_ray(i), interval(0.001, infinity), rec);
+                finish_hit(cam, i, found, rec, features);
+            }
+        }
+
+        auto intersect_start = std::chrono::steady_clock::now();
+        uint64_t traced = 0;
+
+        int packet_size = std::min(std::max(packet_rays, 1), kMaxPacketRays);
+        bool packets = bounce == 0 && packet_size > 1;
+
+        uint32_t packet[kMaxPacketRays];
+        ray rays[kMaxPacketRays];
+        interval ray_t[kMaxPacketRays];
+        pixel_sampler sequences[kMaxPacketRays];
+        hit_record recs[kMaxPacketRays];
+        int in_packet = 0;
+
+        auto trace_packet = [&]() {
+            uint64_t found = world.hit_packet(rays, ray_t, in_packet, recs, sequences);
+            for (int k = 0; k < in_packet; k++)
+                finish_hit(cam, packet[k], (found >> k & 1) != 0, recs[k], features);
+            packet_ray_count += in_packet > 1 ? in_packet : 0;
+            in_packet = 0;
+        };
+
+        for (size_t i = 0; i < n; i++) {
+            if (bounce == 0 && queue.first[i] != nullptr) continue;
+            resume(i, dimension);
+            traced++;
+
+            ray r = queue.path_ray(i);
+            if (packets) {
+                packet[in_packet] = static_cast<uint32_t>(i);
+                rays[in_packet] = r;
+                ray_t[in_packet] = interval(0.001, infinity);
+                sequences[in_packet] = thread_sampler();
+                if (++in_packet == packet_size)
+                    trace_packet();
+                continue;
+            }
+
+            hit_record rec;
+            bool found = world.hit(r, interval(0.001, infinity), rec);
+            finish_hit(cam, i, found, rec, features);
+        }
+        if (in_packet > 0)
+            trace_packet();
+
+        double intersect_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - intersect_start).count();
+        (bounce == 0 ? primary_count : secondary_count) += traced;
+        (bounce == 0 ? primary_time : secondary_time) += intersect_time;
+    }
+
+    // Stores the closest hit of queue entry i, or ends the path with the background if it missed
+    void finish_hit(const camera& cam, size_t i, bool found, const hit_record& rec, bool features) {
+        if (!found) {
+            uint32_t path = queue.id[i];
+            path_radiance[path] += queue.throughput[i] * cam.background;
+            if (features && !queue.features_found[i])
+                path_features[path].albedo = queue.throughput[i] * cam.background;
+            return;
+        }
+
+        hits.store(i, rec);
+        alive[i] = 1;
+    }
+
+    // Lists the entries that hit something grouped by material, in queue order within a material
+    void sort_by_material() {
+        size_t materials = scene_materials().size();
+        bucket_start.assign(materials + 1, 0);
+        for (size_t i = 0; i < queue.size(); i++)
+            if (alive[i]) bucket_start[hits.material_id[i] + 1]++;
+        for (size_t m = 0; m < materials; m++)
+            bucket_start[m + 1] += bucket_start[m];
+
+        order.resize(bucket_start[materials]);
+        for (size_t i = 0; i < queue.size(); i++)
+            if (alive[i]) order[bucket_start[hits.material_id[i]]++] = static_cast<uint32_t>(i);
+    }
+
+    // One bounce of camera::ray_color for every path that hit something, in material order
+    // The light samples' shadow rays are queued for the shadow stage instead of traced.
+    void shade(const camera& cam, const std::vector<const hittable*>& lights, int bounce, uint32_t dimension,
+               bool features) {
+        int depth = bounce + 1;
+        shadows.clear();
+
+        for (uint32_t i : order) {
+            uint32_t path = queue.id[i];
+            hit_record rec = hits.record(i);
+            ray r = queue.path_ray(i);
+            const material* mat = rec.mat();
+            color& radiance = path_radiance[path];
+            color& throughput = queue.throughput[i];
+
+            resume(i, dimension);
+
+            if (features && !queue.features_found[i]) {
+                path_features[path].albedo = throughput * mat->surface_albedo(rec);
+                path_features[path].normal = rec.normal;
+                queue.features_found[i] = !mat->is_specular();
+            }
+
+            // Add the emission of what was hit
+            color color_from_emission = mat->emitted(rec.u, rec.v, rec.p);
+            if (queue.scatter_pdf[i] > 0 && camera::is_sampled_light(rec.object, lights)) {
+                double light_pdf = rec.object->light_pdf(r, rec) / lights.size();
+                color_from_emission = color_from_emission * camera::power_heuristic(queue.scatter_pdf[i], light_pdf);
+            }
+            radiance += throughput * color_from_emission;
+
+            // The light sample is queued before the scatter test, as in camera::ray_color
+            bool sample_lights = !lights.empty() && !mat->is_specular();
+            if (sample_lights) {
+                seek_sample_dimension(dimension + 5);
+                ray shadow;
+                interval shadow_t;
+                color light;
+                if (cam.light_sample(r, rec, lights, shadow, shadow_t, light)) {
+                    shadows.path.push_back(path);
+                    shadows.shadow.push_back(shadow);
+                    shadows.shadow_t.push_back(shadow_t);
+                    shadows.light.push_back(throughput * light);
+                    shadows.sequence.push_back(thread_sampler());
+                }
+            }
+
+            ray scattered;
+            color attenuation;
+            seek_sample_dimension(dimension + 2);
+            if (!mat->scatter(r, rec, attenuation, scattered)) {
+                alive[i] = 0;
+                continue;
+            }
+
+            queue.scatter_pdf[i] = sample_lights ? mat->pdf(r, rec, scattered.direction()) : 0.0;
+            throughput = throughput * attenuation;
+            queue.origin[i] = scattered.origin();
+            queue.direction[i] = scattered.direction();
+            queue.time[i] = scattered.time();
+
+            // Russian roulette, as in camera::ray_color
+            // The path's light sample still counts if it ends here, as it was taken before.
+            if (depth >= cam.roulette_depth) {
+                seek_sample_dimension(dimension + 9);
+                double survival = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 0.95);
+                if (random_double() >= survival) {
+                    alive[i] = 0;
+                    continue;
+                }
+                throughput /= survival;
+            }
+        }
+    }
+
+    // Adds the light samples whose shadow rays reach their light to their paths
+    // A path's sample comes after the emission shade added and before anything the next bounce
+    // adds, the order camera::ray_color adds them in.
+    void trace_shadows(const hittable& world) {
+        int packet_size = std::min(std::max(packet_rays, 1), kMaxPacketRays);
+        size_t n = shadows.path.size();
+
+        for (size_t first = 0; first < n; first += packet_size) {
+            int count = static_cast<int>(std::min(n - first, static_cast<size_t>(packet_size)));
+            uint64_t blocked;
+            if (count == 1) {
+                thread_sampler() = shadows.sequence[first];
+                blocked = world.occluded(shadows.shadow[first], shadows.shadow_t[first]) ? 1 : 0;
+            } else {
+                blocked = world.occluded_packet(&shadows.shadow[first], &shadows.shadow_t[first], count, &shadows.sequence[first]);
+                packet_ray_count += count;
+            }
+
+            for (int k = 0; k < count; k++)
+                if (!(blocked >> k & 1))
+                    path_radiance[shadows.path[first + k]] += shadows.light[first + k];
+        }
+    }
+};
+
+#endif
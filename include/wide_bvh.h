@@ -0,0 +1,561 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "main.h"
+#include "aabb.h"
+
+#include <cstdint>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define RT_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Node of a wide hierarchy with N children
+// The child boxes are stored as structure of arrays (one lane per child) so all N boxes can be
+// tested against a ray with a few vector instructions.
+template <int N>
+struct wide_bvh_node {
+    float bounds[6][N];     // min x, min y, min z, max x, max y, max z of each child
+    uint32_t child[N];      // Interior child: wide node index, Leaf child: first primitive
+    uint32_t count[N];      // Leaf child: primitive count, 0 for interior children and empty slots
+};
+
+// Ray data shared by every node test, computed once per traversal
+struct wide_bvh_ray {
+    float origin[3];
+    float inv_dir[3];
+    int near_row[3];        // Row of bounds holding the near plane per axis (0-2 or 3-5)
+    int far_row[3];         // Row of bounds holding the far plane per axis
+};
+
+// Relative growth of the far hit distance, covers float rounding in the slab test
+static const float kWideBVHFarScale = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+
+// Portable slab test of all children of a node, returns a bit mask of the children hit and
+// writes their entry distances to tnear
+template <int N>
+inline unsigned intersect_children_scalar(const wide_bvh_node<N>& node, const wide_bvh_ray& r,
+                                          float ray_tmin, float ray_tmax, float* tnear) {
+    unsigned mask = 0;
+    for (int i = 0; i < N; i++) {
+        float tmin = ray_tmin;
+        float tmax = ray_tmax;
+        for (int a = 0; a < 3; a++) {
+            float t0 = (node.bounds[r.near_row[a]][i] - r.origin[a]) * r.inv_dir[a];
+            float t1 = (node.bounds[r.far_row[a]][i] - r.origin[a]) * r.inv_dir[a] * kWideBVHFarScale;
+            // NaN distances (ray parallel to and on a slab plane) leave the interval unchanged
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+        }
+        tnear[i] = tmin;
+        mask |= (tmin <= tmax ? 1u : 0u) << i;
+    }
+    return mask;
+}
+
+#ifdef RT_X86_SIMD
+
+// SSE slab test of the four children of a node
+__attribute__((target("sse2")))
+inline unsigned intersect_children_sse(const wide_bvh_node<4>& node, const wide_bvh_ray& r,
+                                       float ray_tmin, float ray_tmax, float* tnear) {
+    __m128 tmin = _mm_set1_ps(ray_tmin);
+    __m128 tmax = _mm_set1_ps(ray_tmax);
+    const __m128 far_scale = _mm_set1_ps(kWideBVHFarScale);
+
+    for (int a = 0; a < 3; a++) {
+        __m128 origin = _mm_set1_ps(r.origin[a]);
+        __m128 inv_dir = _mm_set1_ps(r.inv_dir[a]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.near_row[a]]), origin), inv_dir);
+        __m128 t1 = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.far_row[a]]), origin), inv_dir), far_scale);
+        // max/min return the second operand for NaN lanes, which keeps the running interval
+        tmin = _mm_max_ps(t0, tmin);
+        tmax = _mm_min_ps(t1, tmax);
+    }
+
+    _mm_storeu_ps(tnear, tmin);
+    return static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(tmin, tmax)));
+}
+
+// AVX2 slab test of the eight children of a node
+__attribute__((target("avx2")))
+inline unsigned intersect_children_avx2(const wide_bvh_node<8>& node, const wide_bvh_ray& r,
+                                        float ray_tmin, float ray_tmax, float* tnear) {
+    __m256 tmin = _mm256_set1_ps(ray_tmin);
+    __m256 tmax = _mm256_set1_ps(ray_tmax);
+    const __m256 far_scale = _mm256_set1_ps(kWideBVHFarScale);
+
+    for (int a = 0; a < 3; a++) {
+        __m256 origin = _mm256_set1_ps(r.origin[a]);
+        __m256 inv_dir = _mm256_set1_ps(r.inv_dir[a]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.near_row[a]]), origin), inv_dir);
+        __m256 t1 = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.far_row[a]]), origin), inv_dir), far_scale);
+        tmin = _mm256_max_ps(t0, tmin);
+        tmax = _mm256_min_ps(t1, tmax);
+    }
+
+    _mm256_storeu_ps(tnear, tmin);
+    return static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ)));
+}
+
+#endif
+
+// Branching factor of the hierarchies, 0 picks the widest the CPU supports, 2 keeps the binary
+// traversal, 4 or 8 force a width
+// One setting for the whole program, shared by every translation unit.
+inline int& wide_bvh_width_setting() {
+    static int setting = 0;
+    return setting;
+}
+
+// Branching factor used for wide hierarchies on this machine
+// 8 when the CPU supports AVX2, 4 otherwise (SSE on x86, the scalar test elsewhere), 2 when
+// wide hierarchies are turned off.
+inline int wide_bvh_width() {
+#ifdef RT_X86_SIMD
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+#else
+    static const bool has_avx2 = false;
+#endif
+    int setting = wide_bvh_width_setting();
+    if (setting == 2) return 2;
+    if (setting == 4 || !has_avx2) return 4;
+    return 8;
+}
+
+// Wide (4 or 8 child) hierarchy collapsed from a binary one
+// Each wide node is made by repeatedly opening the largest interior node of a binary subtree
+// until N nodes are gathered, so a traversal step tests N boxes at once and the tree is about a
+// third (BVH4) or a quarter (BVH8) as deep.
+class wide_bvh {
+  public:
+    // Stack size, each node pushes at most width - 1 entries per level of the binary tree
+    static const int kMaxStackSize = 1024;
+
+    // Rays of a packet that reach a subtree below which each of them goes on alone
+    static const int kMinPacketRays = 4;
+
+    wide_bvh() {}
+
+    bool empty() const { return width == 0; }
+
+    // Collapses a depth-first binary node array into n-wide nodes, n of 2 leaves the tree empty
+    // BinaryNode needs count, offset and bounds().
+    template <typename BinaryNode>
+    void build(const std::vector<BinaryNode>& binary, int n) {
+        width = 0;
+        nodes4.clear();
+        nodes8.clear();
+        const uint32_t none = kNoSlot;
+        slot_of.assign(binary.size(), none);
+        if (binary.empty() || n <= 2)
+            return;
+
+        width = n;
+        if (width == 8) collapse(binary, nodes8, 0);
+        else            collapse(binary, nodes4, 0);
+    }
+
+    // Copies a refit box from the binary node it was collapsed from, if it became a child slot
+    void refresh(uint32_t binary_node, const aabb& box) {
+        uint32_t slot = slot_of[binary_node];
+        if (slot == kNoSlot) return;
+
+        if (width == 8) set_slot(nodes8[slot / 8], slot % 8, box);
+        else            set_slot(nodes4[slot / 4], slot % 4, box);
+    }
+
+    // Traversal with the same contract as linear_bvh::intersect_leaves
+    // Every visited node tests all of its children in one go, the children that are hit are
+    // pushed far to near so the nearest one is visited next, and entries whose entry distance is
+    // past the closest hit are dropped when they are popped.
+    template <typename LeafFn>
+    bool intersect(const ray& r, interval ray_t, LeafFn leaf_hit, uint64_t& visited, uint64_t& box_hits) const {
+        if (width == 8) return traverse<false>(nodes8, r, ray_t, leaf_hit, visited, box_hits);
+        return traverse<false>(nodes4, r, ray_t, leaf_hit, visited, box_hits);
+    }
+
+    // Same traversal, but it returns at the first leaf leaf_hit reports a hit in
+    template <typename LeafFn>
+    bool occluded(const ray& r, interval ray_t, LeafFn leaf_hit, uint64_t& visited, uint64_t& box_hits) const {
+        if (width == 8) return traverse<true>(nodes8, r, ray_t, leaf_hit, visited, box_hits);
+        return traverse<true>(nodes4, r, ray_t, leaf_hit, visited, box_hits);
+    }
+
+    // Packet traversal of up to 64 rays, bit k of a mask stands for ray k
+    // The rays visit the nodes together: each child box is tested against every ray still in the
+    // packet and skipped for all of them when none hits it, and the children are visited near
+    // to far by the nearest entry of any ray. Rays whose direction lies in another octant than
+    // the first ray's, and the rays that reach a subtree fewer than kMinPacketRays strong, are
+    // traced alone with the single ray traversal.
+    // leaf_hit(k, first, count, ray_t, t) tests ray k against a leaf like the leaf_hit of
+    // intersect(), ray_t[k] shrinks to the closest hit of ray k. Returns the mask of rays that hit.
+    template <typename PacketLeafFn>
+    uint64_t intersect_packet(const ray* rays, interval* ray_t, int count, PacketLeafFn leaf_hit,
+                              uint64_t& visited, uint64_t& box_hits) const {
+        if (width == 8) return traverse_packet<false>(nodes8, rays, ray_t, count, leaf_hit, visited, box_hits);
+        return traverse_packet<false>(nodes4, rays, ray_t, count, leaf_hit, visited, box_hits);
+    }
+
+    // Same traversal, a ray leaves the packet at the first leaf it hits; returns the mask of rays
+    // that hit something
+    template <typename PacketLeafFn>
+    uint64_t occluded_packet(const ray* rays, interval* ray_t, int count, PacketLeafFn leaf_hit,
+                             uint64_t& visited, uint64_t& box_hits) const {
+        if (width == 8) return traverse_packet<true>(nodes8, rays, ray_t, count, leaf_hit, visited, box_hits);
+        return traverse_packet<true>(nodes4, rays, ray_t, count, leaf_hit, visited, box_hits);
+    }
+
+  private:
+    static const uint32_t kNoSlot = 0xffffffff;
+    static const uint32_t kLeafFlag = 0x80000000;
+
+    int width = 0;
+    std::vector<wide_bvh_node<4>> nodes4;
+    std::vector<wide_bvh_node<8>> nodes8;
+    std::vector<uint32_t> slot_of;      // Wide node * width + slot for every binary node that became a slot
+
+    // Stored boxes grow by a small relative margin so rounding the ray to float cannot miss them
+    template <int N>
+    static void set_slot(wide_bvh_node<N>& node, int slot, const aabb& box) {
+        for (int a = 0; a < 3; a++) {
+            double lo = box.axis(a).min;
+            double hi = box.axis(a).max;
+            node.bounds[a][slot]     = static_cast<float>(lo - 1e-5 * (1.0 + fabs(lo)));
+            node.bounds[a + 3][slot] = static_cast<float>(hi + 1e-5 * (1.0 + fabs(hi)));
+        }
+    }
+
+    // Builds the wide node for the binary subtree rooted at binary node b, returns its index
+    template <typename BinaryNode, int N>
+    uint32_t collapse(const std::vector<BinaryNode>& binary, std::vector<wide_bvh_node<N>>& nodes, uint32_t b) {
+        uint32_t index = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(wide_bvh_node<N>());
+
+        // Gather up to N binary nodes, always opening the interior node with the largest area
+        uint32_t gathered[N];
+        int count = 0;
+        if (binary[b].count > 0) {
+            gathered[count++] = b;
+        } else {
+            gathered[count++] = b + 1;
+            gathered[count++] = binary[b].offset;
+        }
+
+        while (count < N) {
+            int best = -1;
+            double best_area = -1;
+            for (int i = 0; i < count; i++) {
+                const BinaryNode& node = binary[gathered[i]];
+                double area = node.bounds().surface_area();
+                if (node.count == 0 && area > best_area) {
+                    best = i;
+                    best_area = area;
+                }
+            }
+            if (best < 0) break;
+
+            uint32_t opened = gathered[best];
+            gathered[best] = opened + 1;
+            gathered[count++] = binary[opened].offset;
+        }
+
+        // Empty slots get an inverted box, which no ray can hit
+        for (int i = 0; i < N; i++) {
+            for (int a = 0; a < 3; a++) {
+                nodes[index].bounds[a][i] = std::numeric_limits<float>::infinity();
+                nodes[index].bounds[a + 3][i] = -std::numeric_limits<float>::infinity();
+            }
+            nodes[index].child[i] = 0;
+            nodes[index].count[i] = 0;
+        }
+
+        for (int i = 0; i < count; i++) {
+            const BinaryNode& node = binary[gathered[i]];
+            slot_of[gathered[i]] = index * N + i;
+            set_slot(nodes[index], i, node.bounds());
+
+            if (node.count > 0) {
+                nodes[index].child[i] = node.offset;
+                nodes[index].count[i] = node.count;
+            } else {
+                uint32_t child = collapse(binary, nodes, gathered[i]);
+                nodes[index].child[i] = child;
+            }
+        }
+
+        return index;
+    }
+
+    static unsigned intersect_children(const wide_bvh_node<4>& node, const wide_bvh_ray& r,
+                                       float tmin, float tmax, float* tnear) {
+#ifdef RT_X86_SIMD
+        return intersect_children_sse(node, r, tmin, tmax, tnear);
+#else
+        return intersect_children_scalar<4>(node, r, tmin, tmax, tnear);
+#endif
+    }
+
+    static unsigned intersect_children(const wide_bvh_node<8>& node, const wide_bvh_ray& r,
+                                       float tmin, float tmax, float* tnear) {
+#ifdef RT_X86_SIMD
+        return intersect_children_avx2(node, r, tmin, tmax, tnear);
+#else
+        return intersect_children_scalar<8>(node, r, tmin, tmax, tnear);
+#endif
+    }
+
+    static wide_bvh_ray make_ray(const ray& r) {
+        wide_bvh_ray wr;
+        for (int a = 0; a < 3; a++) {
+            double d = r.direction()[a];
+            wr.origin[a] = static_cast<float>(r.origin()[a]);
+            wr.inv_dir[a] = static_cast<float>(1.0 / d);
+            wr.near_row[a] = d < 0 ? a + 3 : a;
+            wr.far_row[a] = d < 0 ? a : a + 3;
+        }
+        return wr;
+    }
+
+    // Upper end of a ray interval as a float that does not cut it short
+    static float far_limit(const interval& ray_t) {
+        float limit = static_cast<float>(ray_t.max);
+        if (limit < ray_t.max) limit = std::nextafter(limit, std::numeric_limits<float>::infinity());
+        return limit;
+    }
+
+    // Number of rays in a packet mask
+    static int ray_count(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_popcountll(mask);
+#else
+        int n = 0;
+        for (; mask != 0; mask &= mask - 1) n++;
+        return n;
+#endif
+    }
+
+    // Index of the lowest ray in a nonzero packet mask
+    static int first_ray(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(mask);
+#else
+        int k = 0;
+        for (; !(mask & 1); mask >>= 1) k++;
+        return k;
+#endif
+    }
+
+    // AnyHit stops at the first hit instead of shrinking the interval to it
+    // The traversal starts at root, a wide node index or a leaf reference, the whole tree by default.
+    template <bool AnyHit, int N, typename LeafFn>
+    static bool traverse(const std::vector<wide_bvh_node<N>>& nodes, const ray& r, interval ray_t,
+                         LeafFn& leaf_hit, uint64_t& visited, uint64_t& box_hits, uint32_t root = 0) {
+        if (nodes.empty())
+            return false;
+
+        wide_bvh_ray wr = make_ray(r);
+
+        struct entry {
+            uint32_t ref;       // Wide node index, or wide node * N + slot with kLeafFlag for leaves
+            float tnear;        // Entry distance into the box
+        };
+
+        entry stack[kMaxStackSize];
+        int stack_size = 0;
+        stack[stack_size++] = { root, static_cast<float>(ray_t.min) };
+
+        bool hit_anything = false;
+
+        while (stack_size > 0) {
+            entry e = stack[--stack_size];
+
+            // Boxes entered past the closest hit cannot hold a closer one
+            if (e.tnear > ray_t.max)
+                continue;
+
+            if (e.ref & kLeafFlag) {
+                uint32_t ref = e.ref & ~kLeafFlag;
+                const wide_bvh_node<N>& node = nodes[ref / N];
+                uint32_t first = node.child[ref % N];
+                uint32_t count = node.count[ref % N];
+
+                double t;
+                if (leaf_hit(first, count, ray_t, t)) {
+                    if (AnyHit) return true;
+                    hit_anything = true;
+                    ray_t.max = t;
+                }
+                continue;
+            }
+
+            const wide_bvh_node<N>& node = nodes[e.ref];
+            visited++;
+
+            float tnear[N];
+            unsigned mask = intersect_children(node, wr, static_cast<float>(ray_t.min), far_limit(ray_t), tnear);
+
+            // Sort the children that were hit far to near, then push them in that order
+            entry hits[N];
+            int hit_count = 0;
+            for (int i = 0; i < N; i++) {
+                if (!(mask & (1u << i))) continue;
+
+                entry h;
+                h.ref = node.count[i] > 0 ? ((e.ref * N + i) | kLeafFlag) : node.child[i];
+                h.tnear = tnear[i];
+
+                int j = hit_count++;
+                while (j > 0 && hits[j - 1].tnear < h.tnear) {
+                    hits[j] = hits[j - 1];
+                    j--;
+                }
+                hits[j] = h;
+            }
+
+            box_hits += hit_count;
+            for (int i = 0; i < hit_count; i++)
+                stack[stack_size++] = hits[i];
+        }
+
+        return hit_anything;
+    }
+
+    // Packet traversal behind intersect_packet and occluded_packet
+    template <bool AnyHit, int N, typename PacketLeafFn>
+    static uint64_t traverse_packet(const std::vector<wide_bvh_node<N>>& nodes, const ray* rays, interval* ray_t, int count,
+                                    PacketLeafFn& leaf_hit, uint64_t& visited, uint64_t& box_hits) {
+        if (nodes.empty() || count <= 0)
+            return 0;
+
+        uint64_t hits = 0;
+
+        // Traces ray k alone through the subtree at root
+        auto trace_alone = [&](int k, uint32_t root) {
+            double t = ray_t[k].max;
+            auto single_leaf = [&](uint32_t first, uint32_t leaf_count, const interval& t_range, double& leaf_t) {
+                if (!leaf_hit(k, first, leaf_count, t_range, leaf_t)) return false;
+                if (!AnyHit) t = leaf_t;
+                return true;
+            };
+            if (traverse<AnyHit>(nodes, rays[k], ray_t[k], single_leaf, visited, box_hits, root)) {
+                hits |= 1ull << k;
+                if (!AnyHit) ray_t[k].max = t;
+            }
+        };
+
+        // Rays in the first ray's octant form the packet, the others go alone
+        wide_bvh_ray wr[64];
+        uint64_t packet = 0;
+        float packet_tmin = std::numeric_limits<float>::infinity();
+        for (int k = 0; k < count; k++) {
+            wr[k] = make_ray(rays[k]);
+            bool same_octant = true;
+            for (int a = 0; a < 3; a++)
+                same_octant = same_octant && wr[k].near_row[a] == wr[0].near_row[a];
+            if (!same_octant) {
+                trace_alone(k, 0);
+                continue;
+            }
+            packet |= 1ull << k;
+            packet_tmin = std::min(packet_tmin, static_cast<float>(ray_t[k].min));
+        }
+
+        struct entry {
+            uint32_t ref;       // Wide node index, or wide node * N + slot with kLeafFlag for leaves
+            float tnear;        // Nearest entry distance of the rays into the box
+            uint64_t rays;      // Rays that hit the box
+        };
+
+        entry stack[kMaxStackSize];
+        int stack_size = 0;
+        stack[stack_size++] = { 0, packet_tmin, packet };
+
+        while (stack_size > 0) {
+            entry e = stack[--stack_size];
+
+            // Rays that found a closer hit, or any hit for AnyHit, leave the entry
+            uint64_t active = 0;
+            for (uint64_t m = e.rays; m != 0; m &= m - 1) {
+                int k = first_ray(m);
+                if (!(AnyHit && (hits >> k & 1)) && e.tnear <= ray_t[k].max)
+                    active |= 1ull << k;
+            }
+            if (active == 0)
+                continue;
+
+            // Too few rays left to share the node tests
+            if (ray_count(active) < kMinPacketRays) {
+                for (uint64_t m = active; m != 0; m &= m - 1)
+                    trace_alone(first_ray(m), e.ref);
+                continue;
+            }
+
+            if (e.ref & kLeafFlag) {
+                uint32_t ref = e.ref & ~kLeafFlag;
+                const wide_bvh_node<N>& node = nodes[ref / N];
+                uint32_t first = node.child[ref % N];
+                uint32_t leaf_count = node.count[ref % N];
+
+                for (uint64_t m = active; m != 0; m &= m - 1) {
+                    int k = first_ray(m);
+                    double t;
+                    if (leaf_hit(k, first, leaf_count, ray_t[k], t)) {
+                        hits |= 1ull << k;
+                        if (!AnyHit) ray_t[k].max = t;
+                    }
+                }
+                continue;
+            }
+
+            const wide_bvh_node<N>& node = nodes[e.ref];
+            visited++;
+
+            // Test every child against every ray, gathering which rays hit each child
+            uint64_t child_rays[N] = {};
+            float child_tnear[N];
+            for (int i = 0; i < N; i++)
+                child_tnear[i] = std::numeric_limits<float>::infinity();
+
+            for (uint64_t m = active; m != 0; m &= m - 1) {
+                int k = first_ray(m);
+                float tnear[N];
+                unsigned mask = intersect_children(node, wr[k], static_cast<float>(ray_t[k].min), far_limit(ray_t[k]), tnear);
+                for (int i = 0; i < N; i++) {
+                    if (!(mask & (1u << i))) continue;
+                    child_rays[i] |= 1ull << k;
+                    child_tnear[i] = std::min(child_tnear[i], tnear[i]);
+                    box_hits++;
+                }
+            }
+
+            // Push the children some ray hit far to near
+            entry children[N];
+            int child_count = 0;
+            for (int i = 0; i < N; i++) {
+                if (child_rays[i] == 0) continue;
+
+                entry c;
+                c.ref = node.count[i] > 0 ? ((e.ref * N + i) | kLeafFlag) : node.child[i];
+                c.tnear = child_tnear[i];
+                c.rays = child_rays[i];
+
+                int j = child_count++;
+                while (j > 0 && children[j - 1].tnear < c.tnear) {
+                    children[j] = children[j - 1];
+                    j--;
+                }
+                children[j] = c;
+            }
+
+            for (int i = 0; i < child_count; i++)
+                stack[stack_size++] = children[i];
+        }
+
+        return hits;
+    }
+};
+
+#endif
@@ -1,11 +1,14 @@
 #include "../include/main.h"
 #include <atomic>
+#include <chrono>
+#include <cinttypes>
 #include <iostream>
 
 #include "../include/color.h"
 #include "../include/vec3.h"
 #include "../include/ray.h"
 #include "../include/hittable_list.h"
+#include "../include/bvh.h"
 #include "../include/sphere.h"
 #include "../include/camera.h"
 #include "../include/material.h"
@@ -13,9 +16,11 @@
 #include "../include/triangle.h"
 #include "../include/OBJModel.h"
 #include "../include/PolygonMesh.h"
+#include "../include/instance.h"
 #include "../include/texture.h"
 #include "../include/quad.h"
 #include "../include/constant_medium.h"
+#include "../include/renderer.h"
 
 // Variables for performance logging
 std::atomic<uint64_t> numRayTrianglesTests(0);
@@ -24,28 +29,29 @@ std::atomic<uint64_t> boundingVolumeIsect(0);
 std::atomic<uint64_t> objectIsect(0);
 static uint64_t numPrimaryRays = 0;
 std::atomic<uint64_t> totalNumTris(0);
+std::atomic<uint64_t> numBVHTraversals(0);
+std::atomic<uint64_t> numBVHNodeVisits(0);
+std::atomic<uint64_t> numBVHBuilds(0);
+std::atomic<uint64_t> bvhBuildMicroseconds(0);
+double bvhSAHCostTotal = 0;
+std::atomic<uint64_t> numBVHRefits(0);
+std::atomic<uint64_t> bvhRefitMicroseconds(0);
+std::atomic<uint64_t> numPathSegments(0);
+static double traceSeconds = 0;
 
 
 // View requirement
-void render_scene(std::ofstream& outFile, const camera& cam, const hittable_list& world, int image_width, int image_height, int samples_per_pixel, int max_depth) {
-    outFile << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-
-    for (int j = image_height-1; j >= 0; --j) {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-
-        for (int i = 0; i < image_width; ++i) {
-            color pixel_color(0,0,0);
-            // Antialiasing requirement
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                auto u = (i + random_double()) / (image_width-1);
-                auto v = (j + random_double()) / (image_height-1);
-                ray r = cam.get_ray(u, v);
-                numPrimaryRays++;
-                pixel_color += cam.ray_color(r, world, max_depth);
-            }
-            write_color(outFile, pixel_color, samples_per_pixel);
-        }
-    }
+// Renders the frame with the tile renderer on all threads, denoised if the renderer is set to,
+// and writes it once it is complete
+void render_scene(std::ofstream& outFile, renderer& tile_renderer, const camera& cam, const hittable& world, int image_width, int image_height, int samples_per_pixel, int max_depth) {
+    auto traceStart = std::chrono::steady_clock::now();
+
+    tile_renderer.render(cam, world, image_width, image_height, samples_per_pixel, max_depth);
+    numPrimaryRays += tile_renderer.last_frame_samples();
+
+    traceSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - traceStart).count();
+
+    tile_renderer.write_ppm(outFile);
 }
 
 //hittable_list day_and_night_setup() {
@@ -197,9 +203,15 @@ hittable_list poke_ball_test(shared_ptr<sphere> pokeball, hittable_list world, i
         pokeball->translate(point3(-0.25, 0, -0.75));
     }
     else if (i <= 37) {
-        // Start out at 0.5 and work up
-        auto light = make_shared<diffuse_light>(color((0.95*(i-32)), (0.95*(i-32)), (0.85*(i-32))));
-        world.add(make_shared<sphere>(point3(57.625, 28, 41.125), 4, light));
+        // Start out at 0.95 and work up
+        // One light is brightened in place, a new material every frame would stay in the
+        // material table for the rest of the program
+        static auto light = make_shared<diffuse_light>(color(0, 0, 0));
+        static auto lamp = make_shared<sphere>(point3(57.625, 28, 41.125), 4, light);
+        light->set_color(color((0.95*(i-32)), (0.95*(i-32)), (0.85*(i-32))));
+        lamp->material_changed();
+        if (i == 33)
+            world.add(lamp);
         // auto light = make_shared<diffuse_light>(color((-33+i), (-33+i), (-33+i)));
         // world.add(make_shared<sphere>(point3(84.375, 25, 47.375), 4, light));
         std::cout << pokeball->get_center().x() << std::endl;
@@ -246,6 +258,33 @@ hittable_list cornell_box() {
    return world;
 }
 
+// Scatters count copies of the bunny across the floor of the box
+// Every copy is an instance of one shared mesh, so the triangles are only stored once
+hittable_list bunny_field(hittable_list world, int count) {
+    OBJModel obj = OBJModel("bunny_centered_247_faces.obj");
+    auto bunny = make_shared<PolygonMesh>(obj, make_shared<lambertian>(color(0.9, 0.6, 0.4)));
+
+    auto field = make_shared<tlas>();
+    int per_row = static_cast<int>(ceil(sqrt(count)));
+    double spacing = 138.75 / per_row;
+    double scale = 0.5 * spacing;
+
+    for (int n = 0; n < count; n++) {
+        // Lift each bunny so its feet rest on the floor
+        point3 position((n % per_row + 0.5) * spacing, 0.56 * scale, (n / per_row + 0.5) * spacing);
+
+        transform placement = transform::translation(position)
+                            * transform::rotation(vec3(0, 1, 0), random_double(0, 360))
+                            * transform::scaling(vec3(scale, scale, scale));
+        field->add(bunny, placement);
+    }
+
+    field->build();
+    world.add(field);
+
+    return world;
+}
+
 hittable_list deconstructed_box(hittable_list world, int i, shared_ptr<quad> green_wall, shared_ptr<quad> red_wall, shared_ptr<quad> white_wall) {
     
     
@@ -306,19 +345,32 @@ hittable_list pokeball_roll_transformation(shared_ptr<sphere> sphere1, point3 fl
 
 int main() {
 
-    clock_t timeStart = clock();
+    // Wall time, clock() would add up the CPU time of every render thread
+    auto timeStart = std::chrono::steady_clock::now();
 
     // Image
     const auto aspect_ratio = 1.0; //16.0 / 9.0;
     const int image_width = 1000;
     const int image_height = static_cast<int>(image_width / aspect_ratio);
-    const int samples_per_pixel = 900;
+    const int samples_per_pixel = 100;  // Light sampling matches the noise of 900 samples without it
     const int max_depth = 50;
+    const int render_threads = 0;   // 0 uses one thread per hardware thread
+
+    // Renderer features, all off renders every frame in full like the original renderer
+    const bool adaptive_sampling = false;   // Stop sampling pixels once they are clean and spend their samples on the noisy ones
+    const bool write_error_maps = false;    // Write the relative error of every pixel to error<N>.ppm when adaptive
+    const bool denoise = false;             // Filter the remaining noise, guided by the albedo and normal of the first surface
+    const bool temporal = false;            // Start every frame from the previous frame's samples where the surface did not change
+    const bool incremental = false;         // Render again only the tiles whose paths met an object that moved since the last frame
+    const bool primary_cache = false;       // Start camera rays from the first hits of the last frame, while the camera holds still
+    const bool wavefront = false;           // Trace paths in queues a bounce at a time, so hits of the same material are shaded together
+    const char* render_cache = "";          // Directory frames are copied from when their scene and settings were rendered before, "" for none
     
 
 
 
     auto world = cornell_box();
+    //world = bunny_field(world, 1000);
 
 
 
@@ -407,6 +459,21 @@ int main() {
 
     int frames = 40;
 
+    // Acceleration requirement
+    // Flattened bounding volume hierarchy over the scene, kept across frames so frames that only
+    // move a few objects refit it instead of building it again
+    bvh_scene world_bvh;
+
+    // Tiles of every frame run on the same pool of threads
+    parallel_thread_setting() = render_threads;
+    renderer tile_renderer;
+    tile_renderer.adaptive_sampling = adaptive_sampling;
+    tile_renderer.denoise = denoise;
+    tile_renderer.temporal = temporal;
+    tile_renderer.incremental = incremental;
+    tile_renderer.primary_cache = primary_cache;
+    tile_renderer.wavefront = wavefront;
+    tile_renderer.cache.directory = render_cache;
 
     // Loop to render three images with different rotations
     // View requirement
@@ -418,6 +485,8 @@ int main() {
 
         // world = deconstructed_box(world, i, green_wall, red_wall, white_wall);
 
+        world_bvh.update(world);
+
         
         
 
@@ -430,19 +499,56 @@ int main() {
         std::string remaining_frames = "Frames remaining: " + std::to_string(frames-i);
         std::cout << remaining_frames << std::endl;
         // Render scene
-        render_scene(outFile, cam, world, image_width, image_height, samples_per_pixel, max_depth);
+        render_scene(outFile, tile_renderer, cam, world_bvh, image_width, image_height, samples_per_pixel, max_depth);
+        if (tile_renderer.last_frame_cached())
+            printf("Frame %d copied from the render cache\n", i+1);
+        else if (tile_renderer.incremental)
+            printf("Frame %d re-rendered: %04.2f (%%)\n", i+1, 100.0 * tile_renderer.last_frame_redrawn());
+
+        // Relative error of every pixel, white where it is twice the adaptive threshold or more
+        if (write_error_maps && tile_renderer.adaptive_sampling && !tile_renderer.last_frame_cached()) {
+            std::ofstream errorFile("error" + std::to_string(i+1) + ".ppm");
+            tile_renderer.write_error_map(errorFile);
+        }
     }
 
     // Output ray intersection data
-    clock_t timeEnd = clock();
+    auto timeEnd = std::chrono::steady_clock::now();
     printf("\n");
-    printf("Render time                                   : %04.2f (sec)\n", (float)(timeEnd - timeStart) / CLOCKS_PER_SEC);
-    printf("Total number of triangles                     : %llu\n", totalNumTris.load());
-    printf("Total number of primary rays                  : %llu\n", numPrimaryRays);
-    printf("Total number of ray-triangles tests           : %llu\n", numRayTrianglesTests.load());
-    printf("Total number of ray-triangles intersections   : %llu\n", numRayTrianglesIsect.load());
-    printf("Total number of Bounding Volume intersections : %llu\n", boundingVolumeIsect.load());
-    printf("Total number of object intersections          : %llu\n", objectIsect.load());
+    printf("Render time                                   : %04.2f (sec)\n", std::chrono::duration<double>(timeEnd - timeStart).count());
+    printf("Denoise time                                  : %04.2f (sec)\n", tile_renderer.denoise_time());
+    printf("Render threads                                : %d\n", tile_renderer.thread_count());
+    printf("Parallel efficiency                           : %04.2f (%%)\n", 100.0 * tile_renderer.parallel_efficiency());
+    printf("Total number of triangles                     : %" PRIu64 "\n", totalNumTris.load());
+    printf("Total number of primary rays                  : %" PRIu64 "\n", numPrimaryRays);
+    printf("Pixel sampler                                 : %s\n", sampler_name(tile_renderer.sampler));
+    printf("Path integrator                               : %s\n", tile_renderer.wavefront ? "wavefront" : "depth first");
+    printf("Primary ray throughput                        : %04.2f (Mrays/sec per thread)\n", tile_renderer.primary_ray_rate() / 1e6);
+    printf("Secondary ray throughput                      : %04.2f (Mrays/sec per thread)\n", tile_renderer.secondary_ray_rate() / 1e6);
+    if (tile_renderer.wavefront)
+        printf("Camera and shadow rays traced in packets      : %04.2f (%%)\n", 100.0 * tile_renderer.packet_fraction());
+    printf("Adaptive samples taken of budget              : %" PRIu64 " / %" PRIu64 " (%04.2f%% saved)\n", tile_renderer.samples_taken(), tile_renderer.sample_budget(),
+           tile_renderer.sample_budget() ? 100.0 * (1.0 - (double)tile_renderer.samples_taken() / tile_renderer.sample_budget()) : 0.0);
+    printf("Pixels converged                              : %04.2f (%%)\n", 100.0 * tile_renderer.converged_fraction());
+    printf("Mean relative pixel error                     : %04.4f\n", tile_renderer.mean_relative_error());
+    printf("Temporal history reused                       : %04.2f (%%)\n", 100.0 * tile_renderer.history_reuse());
+    printf("Image re-rendered                             : %04.2f (%%)\n", 100.0 * tile_renderer.redrawn_fraction());
+    printf("Camera rays answered by the first hit cache   : %04.2f (%%)\n", 100.0 * tile_renderer.primary_cache_reuse());
+    printf("Frames copied from the render cache           : %" PRIu64 " / %d\n", tile_renderer.frames_from_cache(), frames);
+    printf("Average path length                           : %04.2f (segments)\n", numPrimaryRays ? (double)numPathSegments.load() / numPrimaryRays : 0.0);
+    printf("Total number of ray-triangles tests           : %" PRIu64 "\n", numRayTrianglesTests.load());
+    printf("Total number of ray-triangles intersections   : %" PRIu64 "\n", numRayTrianglesIsect.load());
+    printf("Total number of Bounding Volume intersections : %" PRIu64 "\n", boundingVolumeIsect.load());
+    printf("Total number of object intersections          : %" PRIu64 "\n", objectIsect.load());
+    printf("BVH branching factor                          : %d\n", wide_bvh_width());
+    printf("Total number of BVH traversals                : %" PRIu64 "\n", numBVHTraversals.load());
+    printf("Average BVH nodes visited per traversal       : %04.2f\n", numBVHTraversals.load() ? (double)numBVHNodeVisits.load() / numBVHTraversals.load() : 0.0);
+    printf("BVH traversal throughput                      : %04.2f (Mrays/sec)\n", traceSeconds > 0 ? numBVHTraversals.load() / traceSeconds / 1e6 : 0.0);
+    printf("Total number of BVH builds                    : %" PRIu64 "\n", numBVHBuilds.load());
+    printf("BVH build time                                : %04.2f (ms)\n", bvhBuildMicroseconds.load() / 1000.0);
+    printf("Average BVH SAH cost                          : %04.2f\n", numBVHBuilds.load() ? bvhSAHCostTotal / numBVHBuilds.load() : 0.0);
+    printf("Total number of BVH refits                    : %" PRIu64 "\n", numBVHRefits.load());
+    printf("BVH refit time                                : %04.2f (ms)\n", bvhRefitMicroseconds.load() / 1000.0);
 
 
     std::cerr << "\nDone.\n";